@@ -1,779 +1,4683 @@
-// Modified window event hook program, based on example from R. Chen
-// Makes a text log entry whenever a task switch occurs, noting the new process of
-// the window which gained focus, the presumed process of the presumed previous
-// window which lost focus, and the time of the event.
-
-// Standard C++ header files
-//#include <stdio.h>
-#include <iostream>
-#include <utility>
-#include <unordered_map>
-#include <unordered_set>
-//#include <conio.h>
-
-// Header file for Windows
-// Enables strict typing in Windows.h
-#define STRICT
-#define NTDDL_VERSION 0x0A000007
-#define _WIN32_WINNT 0x0A00
-#define WINVER 0x0A00
-// Should add LEAN_AND_MEAN and some NOxxx defines here later for optimization
-// For now, just include everything and worry about optimizing later
-#include <windows.h>
-// Header file for multimedia system, needed for PlaySound if pruning windows.h
-#include <mmsystem.h>
-//#include <combaseapi.h>
-#include <objbase.h>
-#include <mmdeviceapi.h>
-#include <audioclient.h>
-#include <audiopolicy.h>
-#include <ppl.h>
-#include <concurrent_queue.h>
-
-
-//#define AUDCLNT_S_NO_SINGLE_PROCESS AUDCLNT_SUCCESS (0x00d)
-
-// Remind the compiler to remind the linker to actually link the Windows libraries
-#pragma comment(lib, "user32.lib")
-// Needed for mecia APIs like PlaySound
-#pragma comment(lib, "winmm.lib")
-// Needed for system time API
-#pragma comment(lib, "kernel32.lib")
-// Needed for COM
-#pragma comment(lib, "ole32.lib")
-
-//using namespace concurrency;
-using namespace std;
-
-#define LOGGING true
-#define COM_AUDIO_ACTIVE true
-#define AUDCLNT_S_NO_SINGLE_PROCESS AUDCLNT_SUCCESS (0x00d)
-
-// Declare and initialize globals
-HANDLE ghEvents[2];
-LPCSTR workEventName = (LPCSTR) "workToDo";
-LPCSTR quitEventName = (LPCSTR) "quitEvent";
-DWORD oldProcessId = 0;
-unordered_multimap<DWORD,IAudioSessionControl2 *> sessionsList;
-CRITICAL_SECTION hashmapCriticalSection;
-unordered_set<LPWSTR> sessionIdSet;
-LPSYNCHRONIZATION_BARRIER lpBarrier;
-concurrent_queue<DWORD[2]> eventQueue;
-
-
-// GetIAudioSessionManager2
-// Retrieves and passes out a pointer to the IAudioSessionManager2 interface for the
-// default audio endpoint device at the address pointed to by ppSessionManager..
-// Returns S_OK if successful, E_POINTER if ppSessionManager is null, E_UNEXPECTED if
-// the address pointed to by ppSessionManager is not empty, or the HRESULT value from
-// any Windows API call which returnes a value other than S_OK (this function aborts
-// at the first such occurrence).
-// The caller must initialize COM in its thread before calling this function, and if
-// this function returns S_OK then the caller must release the IAudioSessionManager2
-// interface when no longer needed by calling its Release() method.  If this function
-// does not return S_OK, then the caller does not need to clean up anything.
-HRESULT GetIAudioSessionManager2(IAudioSessionManager2 ** ppSessionManager)
-{
-  HRESULT hr;
-  IMMDevice * pDev = NULL;
-  IMMDeviceEnumerator * pDevEnum = NULL;
-
-  if(!ppSessionManager)
-  {
-    #if LOGGING
-    printf("ERROR: In-out pointer ppSessionManager == NULL.\n");
-    #endif
-    return E_POINTER;
-  }
-  else if(*ppSessionManager)
-  {
-    #if LOGGING
-    printf("ERROR: Passed ppSessionManager points to a non-null pointer.\n");
-    #endif
-    return E_UNEXPECTED;
-  }
-
-  // Initiaze the MMDevideEnumerator to get the audio endpoint device
-  hr = CoCreateInstance(
-      __uuidof(MMDeviceEnumerator),
-      NULL,
-      CLSCTX_ALL,
-      __uuidof(IMMDeviceEnumerator),
-      (void **) &pDevEnum
-  );
-  if(hr != S_OK) // If something went wrong
-  {
-    #if LOGGING
-    printf("ERROR: CoCreateInstance failed with code %ld.\n", hr);
-    #endif
-    return hr;
-  }
-  // Get the audio endpoint device
-  hr = pDevEnum -> GetDefaultAudioEndpoint(eRender, eConsole, &pDev);
-  // We're done with the device enumerator, one way or the other
-  pDevEnum -> Release();
-  if(hr != S_OK) // If something went wrong
-  {
-    #if LOGGING
-    printf("ERROR: GetDefaultAudioEndpoint failed with code %ld.\n", hr);
-    #endif
-    return hr;
-  }
-
-  hr = pDev -> Activate(
-    __uuidof(IAudioSessionManager2),
-    CLSCTX_ALL,
-    NULL,
-    (void **) ppSessionManager
-  );
-  pDev -> Release();
-  #if LOGGING
-  if(hr != S_OK)
-  {
-    printf("ERROR: Activate IAudioSessionManager2 failed with code %ld.", hr);
-  }
-  else
-  {
-    printf("IAudioSessionManager2 initialized.");
-  }
-  #endif
-  return hr;
-}
-
-// Add an audio session to the programs internal tracker
-// Prints information about the session and adds it to session list
-// This method will increase the ref count to pSession if it succeeds
-// Caller should release pSession when caller is done with it
-HRESULT AddAudioSession(IAudioSessionControl2 * pSession, IAudioSessionEvents * pAudioSessionEvents)
-{
-  if(!pSession)
-  {
-    #if LOGGING
-    printf("ERROR: AddAudioSession received a null pointer.\n");
-    #endif
-    return E_POINTER;
-  }
-  HRESULT hr = S_OK;
-  DWORD sessionProcessId;
-  LPWSTR pswDisplayName = NULL;
-  LPWSTR pswSessionId = NULL;
-  LPWSTR pswSessionInstance = NULL;
-  LPWSTR pswFullSessionId = NULL;
-  hr = pSession -> GetDisplayName(&pswDisplayName);
-  if(hr != S_OK)
-  {
-    #if LOGGING
-    printf("ERROR: GetDisplayName failed with error code: %ld\n", hr);
-    #endif
-    return hr;
-  }
-  hr = pSession -> GetSessionIdentifier(&pswSessionId);
-  if(hr != S_OK)
-  {
-    #if LOGGING
-    printf("ERROR: GetSessionIndentifier failed with error code: %ld\n", hr);
-    #endif
-    CoTaskMemFree(pswDisplayName);
-    return hr;
-  }
-  hr = pSession -> GetSessionInstanceIdentifier(&pswSessionInstance);
-  if(hr != S_OK)
-  {
-    #if LOGGING
-    printf("ERROR: GetSessionInstanceIdentifier failed with error code: %ld\n", hr);
-    #endif
-    CoTaskMemFree(pswDisplayName);
-    CoTaskMemFree(pswSessionId);
-    return hr;
-  }
-
-  hr = pSession -> GetProcessId(&sessionProcessId);
-  if(hr != S_OK && hr != AUDCLNT_S_NO_SINGLE_PROCESS)
-  {
-    #if LOGGING
-    printf("ERROR: GetProcessId failed with error code: %ld\n", hr);
-    #endif
-    return hr;
-  }
-  printf("Audio Session found. Process: %ld, Name: %ls, Identifier: %ls, Instance: %ls\n", sessionProcessId, pswDisplayName, pswSessionId, pswSessionInstance);
- // wstring swFullSessionId = std::to_wstring(sessionProcessId).append((wstring) "!").append(*pswSessionId).append((wstring) "!").append(*pswSessionInstance);
-//  pswFullSessionId = (LPWSTR) swFullSessionId;
-
-  CoTaskMemFree(pswDisplayName);
-  CoTaskMemFree(pswSessionId);
-  CoTaskMemFree(pswSessionInstance);
-
-  if(sessionIdSet.count(pswFullSessionId))
-  {
-    printf("This session is a duplicate.");
-    CoTaskMemFree(pswFullSessionId);
-    return S_OK;
-  }
-
-  sessionIdSet.insert(pswFullSessionId);
-
-  CoTaskMemFree(pswFullSessionId);
-
-  if(hr == AUDCLNT_S_NO_SINGLE_PROCESS)
-  {
-    // Special handling for cross-process session
-    printf("This session is a cross-process audio session.\n");
-  }
-
-  hr = pSession -> RegisterAudioSessionNotification(pAudioSessionEvents);
-  if(hr != S_OK && hr != E_POINTER)
-  {
-    #if LOGGING
-    printf("ERROR: RegisterAudioSessionNotification failed with error code %ld\n", hr);
-    #endif
-    return hr;
-  }
-
-  EnterCriticalSection(&hashmapCriticalSection);
-  sessionsList.insert(make_pair(sessionProcessId, pSession));
-  pSession -> AddRef();
-  LeaveCriticalSection(&hashmapCriticalSection);
-
-  return hr;
-}
-
-// Callback for new audio session creation
-// Mostly copied from Microsoft Learn IAudioSessionNotification example
-// The contents of OnSessionCreated have been modified, and errors in the definition fixed
-class CSessionNotifier: public IAudioSessionNotification
-{
-private:
-
-    LONG m_cRefAll;
-    HWND m_hwndMain;
-    IAudioSessionEvents * pAudioSessionEvents;
-
-//    ~CSessionNotifier(){};
-
-public:
-
-    CSessionNotifier(HWND hWnd, IAudioSessionEvents * pAudioEvents): 
-      m_cRefAll(1),
-      m_hwndMain (hWnd),
-      pAudioSessionEvents (pAudioEvents)
-    {}
-
-    // IUnknown
-    HRESULT STDMETHODCALLTYPE QueryInterface(REFIID riid, void **ppvInterface)  
-    {    
-      if (IID_IUnknown == riid)
-      {
-        AddRef();
-        *ppvInterface = (IUnknown*)this;
-      }
-      else if (__uuidof(IAudioSessionNotification) == riid)
-      {
-        AddRef();
-        *ppvInterface = (IAudioSessionNotification*)this;
-      }
-      else
-      {
-        *ppvInterface = NULL;
-        return E_NOINTERFACE;
-      }
-      return S_OK;
-    }
-    
-    ULONG STDMETHODCALLTYPE AddRef()
-    {
-      return InterlockedIncrement(&m_cRefAll);
-    }
-     
-    ULONG STDMETHODCALLTYPE Release()
-    {
-      ULONG ulRef = InterlockedDecrement(&m_cRefAll);
-      if (0 == ulRef)
-      {
-        delete this;
-      }
-      return ulRef;
-    }
-
-    HRESULT OnSessionCreated(IAudioSessionControl *pNewSession)
-    {
-      if (!pNewSession)
-      {
-        return E_POINTER;
-      }
-      // PostMessage(m_hwndMain, WM_SESSION_CREATED, 0, 0);
-      IAudioSessionControl2 * pCtrl2 = NULL;
-      HRESULT hr = S_OK;
-      hr = pNewSession -> QueryInterface<IAudioSessionControl2>(&pCtrl2);
-      if(hr != S_OK)
-      {
-        #if LOGGING
-        printf("ERROR: QueryInterface for IAudioSessionControl2 failed with error code: %ld\n", hr);
-        #endif
-        return hr;
-      }
-      hr = AddAudioSession(pCtrl2,pAudioSessionEvents);
-      pCtrl2 -> Release();
-      return hr;
-    }
-};
-
-// Callback for audio session event notification
-// Mostly copied from Microsoft Learn IAudioSessionEvents example
-//-----------------------------------------------------------
-// Client implementation of IAudioSessionEvents interface.
-// WASAPI calls these methods to notify the application when
-// a parameter or property of the audio session changes.
-//-----------------------------------------------------------
-class CAudioSessionEvents : public IAudioSessionEvents
-{
-    LONG _cRef;
-
-public:
-    CAudioSessionEvents() :
-        _cRef(1)
-    {
-    }
-
-    ~CAudioSessionEvents()
-    {
-    }
-
-    // IUnknown methods -- AddRef, Release, and QueryInterface
-
-    ULONG STDMETHODCALLTYPE AddRef()
-    {
-        return InterlockedIncrement(&_cRef);
-    }
-
-    ULONG STDMETHODCALLTYPE Release()
-    {
-        ULONG ulRef = InterlockedDecrement(&_cRef);
-        if (0 == ulRef)
-        {
-            delete this;
-        }
-        return ulRef;
-    }
-
-    HRESULT STDMETHODCALLTYPE QueryInterface(
-                                REFIID  riid,
-                                VOID  **ppvInterface)
-    {
-        if (IID_IUnknown == riid)
-        {
-            AddRef();
-            *ppvInterface = (IUnknown*)this;
-        }
-        else if (__uuidof(IAudioSessionEvents) == riid)
-        {
-            AddRef();
-            *ppvInterface = (IAudioSessionEvents*)this;
-        }
-        else
-        {
-            *ppvInterface = NULL;
-            return E_NOINTERFACE;
-        }
-        return S_OK;
-    }
-
-    // Notification methods for audio session events
-
-    HRESULT STDMETHODCALLTYPE OnDisplayNameChanged(
-                                LPCWSTR NewDisplayName,
-                                LPCGUID EventContext)
-    {
-        return S_OK;
-    }
-
-    HRESULT STDMETHODCALLTYPE OnIconPathChanged(
-                                LPCWSTR NewIconPath,
-                                LPCGUID EventContext)
-    {
-        return S_OK;
-    }
-
-    HRESULT STDMETHODCALLTYPE OnSimpleVolumeChanged(
-                                float NewVolume,
-                                BOOL NewMute,
-                                LPCGUID EventContext)
-    {
-        if (NewMute)
-        {
-            printf("MUTE\n");
-        }
-        else
-        {
-            printf("Volume = %d percent\n",
-                   (UINT32)(100*NewVolume + 0.5));
-        }
-
-        return S_OK;
-    }
-
-    HRESULT STDMETHODCALLTYPE OnChannelVolumeChanged(
-                                DWORD ChannelCount,
-                                float NewChannelVolumeArray[],
-                                DWORD ChangedChannel,
-                                LPCGUID EventContext)
-    {
-        return S_OK;
-    }
-
-    HRESULT STDMETHODCALLTYPE OnGroupingParamChanged(
-                                LPCGUID NewGroupingParam,
-                                LPCGUID EventContext)
-    {
-        return S_OK;
-    }
-
-    HRESULT STDMETHODCALLTYPE OnStateChanged(
-                                AudioSessionState NewState)
-    {
-        char *pszState = "?????";
-
-        switch (NewState)
-        {
-        case AudioSessionStateActive:
-            pszState = "active";
-            break;
-        case AudioSessionStateInactive:
-            pszState = "inactive";
-            break;
-        }
-        printf("New session state = %s\n", pszState);
-
-        return S_OK;
-    }
-
-    HRESULT STDMETHODCALLTYPE OnSessionDisconnected(
-              AudioSessionDisconnectReason DisconnectReason)
-    {
-        char *pszReason = "?????";
-
-        switch (DisconnectReason)
-        {
-        case DisconnectReasonDeviceRemoval:
-            pszReason = "device removed";
-            break;
-        case DisconnectReasonServerShutdown:
-            pszReason = "server shut down";
-            break;
-        case DisconnectReasonFormatChanged:
-            pszReason = "format changed";
-            break;
-        case DisconnectReasonSessionLogoff:
-            pszReason = "user logged off";
-            break;
-        case DisconnectReasonSessionDisconnected:
-            pszReason = "session disconnected";
-            break;
-        case DisconnectReasonExclusiveModeOverride:
-            pszReason = "exclusive-mode override";
-            break;
-        }
-        printf("Audio session disconnected (reason: %s)\n",
-               pszReason);
-        
-        // Remoove this session from sessionsList hashmap and sessionIdSet
-        // Problem - OnSessionDisconnected does not give a context pointer...
-        // Do I need to add a pointer to the session to the constructor for
-        // this class, and construct a separate instance for eadh session and
-        // keep a big hashmap of each sessions full ID and assoiated instance
-        // of this class?
-        
-        return S_OK;
-    }
-};
-
-void SwitchMuteStates(DWORD oldProc, DWORD newProc)
-{
-  ISimpleAudioVolume* pVol;
-  EnterCriticalSection(&hashmapCriticalSection);
-  if(sessionsList.count(oldProc))
-  {
-    auto sessions = sessionsList.equal_range(oldProc);
-    for(auto p = sessions.first; p != sessions.second; ++p)
-    {
-      p -> second -> QueryInterface<ISimpleAudioVolume>(&pVol);
-      if(pVol) { pVol -> SetMute(true, NULL); pVol -> Release(); }
-    }
-  }
-  if(sessionsList.count(newProc))
-  {
-    auto sessions = sessionsList.equal_range(newProc);
-    for(auto p = sessions.first; p != sessions.second; ++p)
-    {
-      p -> second -> QueryInterface<ISimpleAudioVolume>(&pVol);
-      if(pVol) { pVol -> SetMute(false, NULL); pVol -> Release(); }
-    }
-  }
-  LeaveCriticalSection(&hashmapCriticalSection);
-}
-
-// Audio Session monitoring thread
-// Populates the list of all active audio sessions and registers a callbback to add
-// any new sessions created while the program is running
-DWORD WINAPI AudioThreadRoutine(_In_ LPVOID pList)
-{
-
-  HRESULT hr = S_OK;
-  IAudioSessionManager2 * pMgr = NULL;
-  IAudioSessionEnumerator * pEnum = NULL;
-  CAudioSessionEvents audioSessionEvents;
-  IAudioSessionEvents * pAudioEvents = &audioSessionEvents;
-  CSessionNotifier sessionNotifier(NULL, pAudioEvents);
-  IAudioSessionNotification * pCallback = &sessionNotifier;
-
-  // Initialize COM for this thread
-  hr = CoInitializeEx(NULL, COINIT_MULTITHREADED);
-  if (hr != S_OK)
-  {
-    if (hr == S_FALSE) { CoUninitialize(); }
-    #if LOGGING
-    printf("ERROR: CoInitializeEx failed with code %ld\n", hr);
-    #endif
-    return 2;
-  }
-
-  // Initialize the IAudioSeesionManager2 interface
-  hr = GetIAudioSessionManager2(&pMgr);
-  if(hr != S_OK)
-  {
-    // No need for logging here - GetIAudioSessionManager2 logs its own errors.
-    CoUninitialize();
-    return 3;
-  }
-
-  //Register callbadk for new audio sessions
-  // Do this first before going through the enumerator, in case new sessions are
-  // created while processing the existing ones
-  hr = pMgr -> RegisterSessionNotification(pCallback);
-  if(hr != S_OK)
-  {
-    pMgr -> Release();
-    CoUninitialize();
-    return 4;
-  }
-
-  // Enumerate all of the existing sessions
-  hr = pMgr -> GetSessionEnumerator(&pEnum);
-  if(hr != S_OK)
-  {
-    #if LOGGING
-    printf("ERROR: GetSessionEnumerator failed with error code %ld\n", hr);
-    #endif
-    pMgr -> UnregisterSessionNotification(pCallback);
-    pMgr -> Release();
-    CoUninitialize();
-    return 5;
-  }
-
-  int numSessions = 0;
-  hr = pEnum -> GetCount(&numSessions);
-  if(hr != S_OK)
-  {
-    #if LOGGING
-    printf("ERROR: Enumerator -> GetCount failed with error code: %ld\n", hr);
-    #endif
-    pMgr -> UnregisterSessionNotification(pCallback);
-    pEnum -> Release();
-    pMgr -> Release();
-    CoUninitialize();
-    return 6;
-  }
-
-  #if LOGGING
-  printf("Preparing to review existing audio sessions. No errors yet.\n");
-  #endif
-  IAudioSessionControl * pCtrl = NULL;
-  IAudioSessionControl2 * pCtrl2 = NULL;
-  for(int i = 0; i < numSessions; i++)
-  {
-    hr = pEnum -> GetSession(i, &pCtrl);
-    if(hr != S_OK) { break; }
-
-    hr = pCtrl -> QueryInterface<IAudioSessionControl2>(&pCtrl2);
-    pCtrl -> Release();
-    if(hr != S_OK) { break; }
-    
-    hr = AddAudioSession(pCtrl2, pAudioEvents);
-    pCtrl2 -> Release();
-    if(hr != S_OK && hr != AUDCLNT_S_NO_SINGLE_PROCESS) { break; }
-  }
-  pEnum -> Release();
-
-  if(hr != S_OK && hr != AUDCLNT_S_NO_SINGLE_PROCESS)
-  {
-    #if LOGGING
-    printf("ERROR: Problem in enumeration loop, error code: %ld\n", hr);
-    #endif
-    pMgr -> UnregisterSessionNotification(pCallback);
-    pMgr -> Release();
-    CoUninitialize();
-    return 7;
-  }
-
-  // Notify the main thread of successful setup and wait
-  SetEvent(ghEvents[0]);
-  EnterSynchronizationBarrier(lpBarrier, 0);
-
-  // Wait for work or quit event. Any non-zero return value
-  // means either the quit event has been set (array index 1) or something
-  // bizarrely wrong has happened (any other non-zero result)
-  while(!WaitForMultipleObjects(2, ghEvents, false, INFINITE))
-  {
-    while(!eventQueue.empty())
-    {
-      DWORD processIds[2];
-      eventQueue.try_pop(&processIds);
-      SwitchMuteStates(processIds[0], processIds[1]);
-    }
-
-  }
-
-  // End o program cleanup
-  pMgr -> UnregisterSessionNotification(pCallback);
-  pMgr -> Release();
-
-  for(auto p : sessionsList)
-  {
-    p.second -> UnregisterAudioSessionNotification(pAudioEvents);
-    p.second -> Release();
-    p.second = NULL;
-  }
-  pAudioEvents -> Release();
-
-  CoUninitialize();
-  return (DWORD) hr;
-}
-
-// Event procssing thread routine
-// Runs in a loop and receives event reports from the callback in the main thread
-
-// Callback function for the WinEvent hook
-// This should be as short as possible and just gather and dispatch
-// information to another thread to actually process the event, and
-// try to avoid any COM calls or Windows messaging if possible to
-// reduce the risk of self-interrupting reentrant execution
-// The callback function should have exactly this argument list
-void CALLBACK WinEventProc(
-    HWINEVENTHOOK hWinEventHook,
-    DWORD event,
-    HWND hwnd,
-    LONG idObject,
-    LONG idChild,
-    DWORD dwEventThread,
-    DWORD dwmsEventTime
-)
-{
-  // Check if this is a window change-of-focus event
-  if (
-      hwnd &&
-      idObject == OBJID_WINDOW &&
-      idChild == CHILDID_SELF &&
-      event == EVENT_SYSTEM_FOREGROUND
-  )
-  {
-    // Get the Process ID of the window which gained focus
-    DWORD switchedProcessId;
-    DWORD switchedThreadId = GetWindowThreadProcessId(hwnd, &switchedProcessId);
-
-    printf("Focus change, window of process %ld thread %ld now has focus.\n", switchedProcessId, switchedThreadId);
-    if(switchedProcessId == oldProcessId) { return; }    
-
-    DWORD processIds[2] = {oldProcessId, switchedProcessId};
-    eventQueue.push(processIds);
-    SetEvent(ghEvents[0]); // Set "work to do" event
-
-    oldProcessId = switchedProcessId; // Set new process as the new "old" process for the next focus change
-  }
-}
-
-
-// Main routine
-// Set hook, start processor thread, run message loop, and clean up at end
-// Main function name and arguments should be exactly this
-int WINAPI WinMain(HINSTANCE hinst, HINSTANCE hinstPrev,
-                   LPSTR lpCmdLine, int nShowCmd)
-{
-
-  setvbuf(stdout, NULL, _IONBF, 0);
-
-  ghEvents[0] = CreateEvent(NULL, false, false, workEventName);
-  if(!ghEvents[0])
-  {
-    #if LOGGING
-    printf("ERROR: Creation of work event failed.\n");
-    #endif
-    return 1;
-  }
-  ghEvents[1] = CreateEvent(NULL, true, false, quitEventName);
-  if(!ghEvents[1])
-  {
-    #if LOGGING
-    printf("ERROR: Creation of quit event failed.\n");
-    #endif
-    return 1;
-  }
-
-  if(!InitializeSynchronizationBarrier(lpBarrier,2,-1));
-  {
-    #if LOGGING
-    printf("ERROR: Creation of synchronization barrier failed.\n");
-    #endif
-    return 1;
-  }
-
-  // Start audio session tracking thread
-  HANDLE hAudioThread = CreateThread(NULL, 0, AudioThreadRoutine, NULL, 0, NULL);
-  if(!hAudioThread)
-  {
-    #if LOGGING
-    printf("ERROR: Failed to start audio session tracking thread.\n");
-    #endif
-    return 2;
-  }
-
-  // Wait for other threads to finish setup.
-  // Wait for the thread itself as well as the ready event, in case the thread aborts
-
-  // Will replace this with ghEvents, with the work event set if thread 2 is ready
-  // or the quit event set if something went wrong.
-  HANDLE hAudioThreadState[2] = {ghEvents[0], hAudioThread};
-
-  DWORD result = WaitForMultipleObjects(2, hAudioThreadState, false, 20000);
-  if(result != WAIT_OBJECT_0)
-  {
-    #if LOGGING
-    printf("ERROR: Failure or timeout in audio thread, return code: %ld\n", result);
-    #endif
-    return 3;
-  }
-
-  EnterSynchronizationBarrier(lpBarrier, 0);
-  DeleteSynchronizationBarrier(lpBarrier);
-
-  // Set the event hook for the callback function
-  HWINEVENTHOOK hWinEventHook = SetWinEventHook(
-     EVENT_SYSTEM_FOREGROUND, EVENT_SYSTEM_FOREGROUND,
-     NULL, WinEventProc, 0, 0,
-     WINEVENT_OUTOFCONTEXT | WINEVENT_SKIPOWNPROCESS);
-
-
-  // Message loop, runs continuously until WM_QUIT or something goes wrong
-  // GetMessage returns a "true" value normally, or a "0" on a WM_QUIT message...
-  // ...or a "-1" (say WHAT, now?!) if some kind of error happens.
-  MSG msg;
-  int b;
-  while ((b = GetMessage(&msg, NULL, 0, 0)) && b != -1) {
-    TranslateMessage(&msg);
-    DispatchMessage(&msg);
-  }
-
-  if (hWinEventHook) UnhookWinEvent(hWinEventHook);
-  SetEvent(ghEvents[1]); // Set the quit event
-
-  // End event procesing thread
-  return 0;
-}
\ No newline at end of file
+// Modified window event hook program, based on example from R. Chen
+// Makes a text log entry whenever a task switch occurs, noting the new process of
+// the window which gained focus, the presumed process of the presumed previous
+// window which lost focus, and the time of the event.
+
+// Standard C++ header files
+//#include <stdio.h>
+#include <iostream>
+#include <array>
+#include <cctype>
+#include <cstdarg>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+//#include <conio.h>
+
+// Header file for Windows
+// Enables strict typing in Windows.h
+#define STRICT
+#define NTDDL_VERSION 0x0A000007
+#define _WIN32_WINNT 0x0A00
+#define WINVER 0x0A00
+// Should add LEAN_AND_MEAN and some NOxxx defines here later for optimization
+// For now, just include everything and worry about optimizing later
+// Winsock 2 has to come before windows.h, which would pull in Winsock 1
+#include <winsock2.h>
+#include <windows.h>
+// Header file for multimedia system, needed for PlaySound if pruning windows.h
+#include <mmsystem.h>
+//#include <combaseapi.h>
+#include <objbase.h>
+#include <mmdeviceapi.h>
+#include <audioclient.h>
+#include <audiopolicy.h>
+// Virtual desktop manager
+#include <shobjidl.h>
+
+
+//#define AUDCLNT_S_NO_SINGLE_PROCESS AUDCLNT_SUCCESS (0x00d)
+
+// Remind the compiler to remind the linker to actually link the Windows libraries
+#pragma comment(lib, "user32.lib")
+// Needed for mecia APIs like PlaySound
+#pragma comment(lib, "winmm.lib")
+// Needed for system time API
+#pragma comment(lib, "kernel32.lib")
+// Needed for COM
+#pragma comment(lib, "ole32.lib")
+// Needed for the metrics socket
+#pragma comment(lib, "ws2_32.lib")
+
+//using namespace concurrency;
+using namespace std;
+
+#define LOGGING true
+#define COM_AUDIO_ACTIVE true
+#define AUDCLNT_S_NO_SINGLE_PROCESS AUDCLNT_SUCCESS (0x00d)
+// Time to wait for focus to settle before applying mute changes, so that Alt-Tab
+// cycling through several windows results in one switch instead of many
+#define FOCUS_DEBOUNCE_MS 50
+// Control pipe served in daemon mode, suffixed with the seat
+#define CONTROL_PIPE_NAME "\\\\.\\pipe\\AutoMute"
+#define CONTROL_BUFFER_SIZE 512
+// Loopback port for the Prometheus metrics exporter; each seat adds its ID
+#define METRICS_PORT 9464
+// Longest name of a per-seat object
+#define SEAT_NAME_SIZE 64
+// Sessions per process kept inline in the session store's process index
+#define SESSION_INLINE_SLOTS 4
+// Size of each block of the session metadata string arena
+#define ARENA_BLOCK_SIZE 65536
+// Longest window class name, including the terminator
+#define WINDOW_CLASS_SIZE 256
+// Stress mode: focus changes per burst, and bursts between session re-enumerations
+#define STRESS_MAX_BURST 16
+#define STRESS_ENUMERATE_EVERY 32
+// Stress mode: simulated windows per process, so the window index sees hundreds
+#define STRESS_WINDOWS_PER_PROCESS 8
+// Stress mode: stand-in groups sessions are moved between
+#define STRESS_GROUPS 4
+// Stress mode: stand-in virtual desktops the stand-in windows are spread over
+#define STRESS_DESKTOPS 3
+// Stress mode: stand-in processes, the sessions each starts with at most, and
+// cross-process sessions besides
+#define STRESS_PROCESSES 64
+#define STRESS_SESSIONS_PER_PROCESS 3
+#define STRESS_CROSS_SESSIONS 4
+
+// Process identity
+// A process ID alone can be reused once its process exits, so processes are
+// identified by their ID and creation time together. startTime is 0 when the
+// creation time couldn't be read, e.g. for protected processes.
+struct ProcessIdentity
+{
+  DWORD processId;
+  ULONGLONG startTime;   // Creation time, as a FILETIME value
+
+  bool operator==(const ProcessIdentity & other) const
+  {
+    return processId == other.processId && startTime == other.startTime;
+  }
+  bool operator!=(const ProcessIdentity & other) const { return !(*this == other); }
+};
+
+struct ProcessIdentityHash
+{
+  size_t operator()(const ProcessIdentity & identity) const
+  {
+    return hash<ULONGLONG>()(identity.startTime ^ ((ULONGLONG) identity.processId << 32 | identity.processId));
+  }
+};
+
+const ProcessIdentity noProcess = {0, 0};
+
+struct GuidHash
+{
+  size_t operator()(const GUID & guid) const
+  {
+    const ULONGLONG * pHalves = (const ULONGLONG *) &guid;
+    return hash<ULONGLONG>()(pHalves[0] ^ pHalves[1]);
+  }
+};
+
+// The most recent focus change, as published by WinEventProc. The sequence number
+// counts every published change, so a reader can tell how many it skipped over.
+struct FocusSnapshot
+{
+  LONG64 sequence;
+  ProcessIdentity process;
+  HWND hwnd;
+  ULONGLONG eventTime;     // Engine clock milliseconds
+  LONGLONG publishTicks;   // Engine clock ticks when published
+  bool fullscreen;         // The window covers its whole monitor
+};
+
+// Latency histogram with fixed bucket bounds, in the Prometheus sense: each
+// bucket counts observations less than or equal to its bound
+#define LATENCY_BUCKET_COUNT 12
+const double latencyBucketBounds[LATENCY_BUCKET_COUNT] =
+{
+  0.00005, 0.0001, 0.00025, 0.0005, 0.001, 0.0025,
+  0.005, 0.01, 0.025, 0.05, 0.1, 0.25
+};
+
+struct LatencyHistogram
+{
+  LONG64 buckets[LATENCY_BUCKET_COUNT];
+  LONG64 count;
+  double sum;
+};
+
+enum LatencyStage { LS_DISPATCH, LS_DEBOUNCE, LS_APPLY, LS_STAGE_COUNT };
+const char * latencyStageNames[LS_STAGE_COUNT] = { "dispatch", "debounce", "apply" };
+
+// Counters reported by the stats command and the metrics exporter. Each group
+// below is written from the threads named above it; where more than one thread
+// writes a counter, it is updated under hashmapCriticalSection or with an
+// interlocked operation. The audio thread reads them all without the lock, so a
+// reader may see a count a moment old, but each is one aligned 64-bit value and
+// is never torn.
+struct EngineStats
+{
+  // Written only by the audio thread
+  LONG64 focusChanges;     // Focus snapshots published
+  LONG64 coalescedChanges; // Snapshots superseded before they were applied
+  LONG64 switchesApplied;  // Calls to SwitchMuteStates
+  LONG64 refreshes;        // Forced refreshes of every session
+  LONG64 switchesHeld;     // Switches held back because the focused process is silent
+  LONG64 desktopSwitches;  // Virtual desktop switches applied in desktop mode
+  LONG64 gameModeEntries;  // Times a fullscreen window took focus
+  LONG64 wakeups;          // Passes of the audio thread's wait loop
+  LONG64 journalUndone;    // Mutes of a previous instance undone from the journal
+  LONG64 controlCommands;  // Commands served on the control pipe
+  LONG64 backendCalls;     // SetMute calls issued
+  LONG64 backendFailures;  // SetMute calls that failed
+  LONG64 metricsScrapes;   // Requests served by the metrics exporter
+  LONG64 invariantChecks;  // Quiescent points checked in stress mode
+  HRESULT lastError;       // Result of the most recent failed backend call
+  // Written by WASAPI's callback threads and the audio thread, under
+  // hashmapCriticalSection
+  LONG64 regroupings;        // Sessions moved to another group
+  LONG64 sessionsRestored;   // Sessions that took over a decision from the snapshot
+  LONG64 journalCompactions; // Times the full journal was rewritten
+  // Written by WASAPI's callback threads, interlocked
+  LONG64 echoedChanges;    // Volume callbacks for changes the engine made
+  LONG64 externalChanges;  // Volume callbacks for changes made by anyone else
+  // Written by the audio thread and the stress threads, interlocked
+  LONG64 invariantViolations;
+  // Written only by the focus source, on the main thread
+  LONG64 windowCacheHits;    // Focus changes to a window already in the window cache
+  LONG64 windowCacheMisses;  // Focus changes to a window seen for the first time
+  LONGLONG windowLookupTicks; // Time spent filling window cache entries
+  LONG64 transientFiltered;  // Focus changes to transient windows ignored
+  // Written only by the audio thread
+  LatencyHistogram latency[LS_STAGE_COUNT];
+};
+
+// String arena
+// Session metadata strings are converted to UTF-8 once and copied into large
+// blocks owned by the device's arena, rather than each living in its own heap
+// allocation. Strings are never freed one at a time: the whole arena goes away
+// with the device, and once most of it belongs to retired sessions the live
+// strings are copied into a fresh arena and the old one is released in bulk.
+struct ArenaString
+{
+  const char * data;   // NUL-terminated UTF-8
+  DWORD length;        // Not counting the NUL
+
+  string_view View() const { return string_view(data, length); }
+};
+
+struct StringArena
+{
+  vector<char *> blocks;
+  size_t blockUsed;     // Bytes used in the last block
+  size_t totalBytes;    // Bytes handed out since the last reset
+  size_t liveBytes;     // Bytes referenced by tracked sessions
+};
+
+// A point in an arena to roll back to, undoing every allocation made since
+struct ArenaMark
+{
+  size_t blockCount;
+  size_t blockUsed;
+  size_t totalBytes;
+};
+
+// Metadata retained for each session, in the session arena
+struct SessionMetadata
+{
+  ArenaString displayName;
+  ArenaString sessionId;
+  ArenaString instanceId;  // Unique to each session
+};
+
+// Session store
+// Tracked sessions live in parallel arrays indexed by slot, so that a switch
+// walks a few dense arrays instead of chasing hash nodes, and each process ID
+// maps to a SlotList which keeps its first few slots inline and only spills to
+// the heap for processes with many sessions. A slot's generation changes every
+// time the slot is reused, so a (slot, generation) pair held by a session's
+// event callback can never refer to a later session in the same slot.
+// Everything here is guarded by hashmapCriticalSection.
+enum SessionFlags : BYTE
+{
+  SF_IN_USE = 1,
+  SF_MUTED = 2,     // Muted, or ducked in duck mode, by the engine
+  SF_CROSS_PROCESS = 4, // Shared by several processes; see CrossProcessPolicy
+  SF_ACTIVE = 8,    // Producing audio, as of the last OnStateChanged
+  SF_OVERRIDE = 16, // Muted or set by the user since; left alone until it ends
+  SF_JOURNALLED = 32 // The journal's last record of the session has it muted
+};
+
+struct SlotList
+{
+  DWORD count;
+  DWORD inlineSlots[SESSION_INLINE_SLOTS];
+  vector<DWORD> overflow;
+
+  SlotList() : count(0) {}
+
+  DWORD operator[](DWORD i) const
+  {
+    return i < SESSION_INLINE_SLOTS ? inlineSlots[i] : overflow[i - SESSION_INLINE_SLOTS];
+  }
+
+  void Add(DWORD slot)
+  {
+    if(count < SESSION_INLINE_SLOTS) { inlineSlots[count] = slot; }
+    else { overflow.push_back(slot); }
+    count++;
+  }
+
+  // Removes slot, moving the last entry into its place
+  void Remove(DWORD slot)
+  {
+    for(DWORD i = 0; i < count; i++)
+    {
+      if((*this)[i] != slot) { continue; }
+      DWORD last = (*this)[count - 1];
+      if(i < SESSION_INLINE_SLOTS) { inlineSlots[i] = last; }
+      else { overflow[i - SESSION_INLINE_SLOTS] = last; }
+      if(count > SESSION_INLINE_SLOTS) { overflow.pop_back(); }
+      count--;
+      return;
+    }
+  }
+};
+
+// Window index entry
+// The platform doesn't say which window a session plays for, so a session is
+// attributed to the window its process last had focused when the session was
+// created. That tells apart e.g. two browser windows, each starting its own
+// media, while sessions created before their process was ever focused follow
+// the process as a whole. Windows are indexed by their root owner, so a dialog
+// or a Find box stands for the window it belongs to.
+struct WindowEntry
+{
+  ProcessIdentity process;
+  SlotList slots;   // Sessions attributed to the window
+  GUID desktop;     // Virtual desktop it was on when last focused, in desktop mode
+};
+
+struct SessionStore
+{
+  vector<ProcessIdentity> processes;
+  vector<HWND> windows;   // Window each session is attributed to, or NULL
+  vector<GUID> groupings;   // Grouping parameter of each session, or GUID_NULL
+  vector<float> levels;     // Volume of each session before any ducking
+  vector<IAudioSessionControl2 *> sessions;
+  vector<ISimpleAudioVolume *> volumes;
+  vector<IAudioSessionEvents *> sinks;
+  vector<BYTE> flags;
+  vector<DWORD> generations;
+  vector<SessionMetadata> metadata;
+  vector<DWORD> freeSlots;
+  unordered_map<ProcessIdentity, SlotList, ProcessIdentityHash> byProcess;
+  SlotList crossProcess;   // Cross-process sessions, which byProcess leaves out
+  // Active sessions per process, cross-process sessions excepted
+  unordered_map<ProcessIdentity, DWORD, ProcessIdentityHash> activeByProcess;
+  unordered_map<HWND, WindowEntry> byWindow;   // Windows focused since they were created
+  unordered_map<ProcessIdentity, HWND, ProcessIdentityHash> lastWindows;
+  // Sessions sharing a grouping parameter are muted and unmuted as one unit
+  unordered_map<GUID, SlotList, GuidHash> byGroup;
+  // Desktop mode: the virtual desktop in view, and per process how many of its
+  // indexed windows are on it
+  GUID currentDesktop;
+  unordered_map<ProcessIdentity, DWORD, ProcessIdentityHash> visibleByProcess;
+  // The focus the mute states were last applied for
+  ProcessIdentity focusedProcess;
+  HWND focusedWindow;
+  bool focusedFollowedApp;   // Whether focusedProcess runs followedAppName
+  size_t count;
+  size_t mutedCount;
+  size_t overrideCount;
+};
+
+// Cross-process session policy
+// A cross-process session, e.g. one of a system service mixing for several
+// clients, has no single process to follow. Its process identity is that of
+// the process which started it, as far as GetProcessId can tell.
+enum CrossProcessPolicy
+{
+  CP_IGNORE,          // Never muted nor unmuted
+  CP_FOLLOW_SERVICE,  // Audible while the process which started it has focus
+  CP_FOLLOW_APP       // Audible while a process running followedAppName has focus
+};
+
+// COM pointers of a removed session, waiting to be released by the audio thread,
+// since a session's callbacks must not unregister themselves
+struct RetiredSession
+{
+  IAudioSessionControl2 * pSession;
+  ISimpleAudioVolume * pVolume;
+  IAudioSessionEvents * pEvents;
+};
+
+// Shared-memory status block
+// A fixed-layout block in a named file mapping, so that external monitors can
+// read the engine state without a round trip through the control pipe. The
+// audio thread is the only writer and guards updates with a seqlock; a reader
+// maps STATUS_MAPPING_NAME.<seat> read-only and takes a snapshot by reading sequence,
+// copying the block, then reading sequence again, retrying if the two values
+// differ or are odd. New fields may only be added at the end, with a new version.
+#define STATUS_MAPPING_NAME "Local\\AutoMuteStatus"
+#define STATUS_BLOCK_MAGIC 0x4554554D // "MUTE"
+#define STATUS_BLOCK_VERSION 2
+
+struct StatusBlock
+{
+  DWORD magic;
+  DWORD version;
+  volatile LONG sequence;
+  DWORD focusState;         // A FocusState value
+  DWORD focusedProcessId;   // Process whose sessions are unmuted
+  HRESULT lastError;        // Most recent failed backend call, or S_OK
+  LONG64 mutedSessions;
+  LONG64 trackedSessions;
+  LONG64 focusChanges;
+  LONG64 switchesApplied;
+  LONG64 backendCalls;
+  LONG64 backendFailures;
+  ULONGLONG updateTime;     // Engine clock milliseconds at the last update
+  // Version 2
+  ULONGLONG focusedProcessStartTime;
+};
+
+// Session snapshot
+// A file-backed mapping holding, for each slot of the session store, the session's
+// identity and the decision applied to it, so that a restarted instance knows
+// which sessions the previous one left muted. Records are written in place as
+// decisions change, with no system call, and the pages reach the file even if
+// the process is killed. Each record carries a check over its fields, so one torn
+// by a crash mid-write is ignored. A new instance reads the records once, then
+// clears them and starts writing its own.
+#define SNAPSHOT_FILE_NAME "AutoMuteSnapshot"
+#define SNAPSHOT_MAGIC 0x50414E53 // "SNAP"
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_CAPACITY 16384   // Slots recorded; later ones aren't
+
+struct SnapshotRecord
+{
+  ULONGLONG instanceHash;   // Hash of the instance identifier, 0 for a free slot
+  ULONGLONG startTime;      // Identity of the session's process
+  DWORD processId;
+  float level;              // The session's own volume, before any ducking
+  DWORD flags;              // SF_MUTED and SF_OVERRIDE as applied
+  DWORD reserved;
+  ULONGLONG check;          // SnapshotCheck of the fields above
+};
+
+struct SessionSnapshot
+{
+  DWORD magic;
+  DWORD version;
+  DWORD capacity;
+  DWORD duckMode;           // Decisions made while ducking can't be restored by muting
+  SnapshotRecord records[SNAPSHOT_CAPACITY];
+};
+
+// Mute journal
+// A file-backed mapping holding an append-only log of the mutes the engine
+// applied and gave back, so that whatever it still had muted when it stopped,
+// killed or not, can be undone by the next instance, or by /recover, in one
+// pass over the changes. A record is written before the count is raised over it, so a kill
+// never leaves a half-written record counted, and appending is a plain memory
+// write with no system call. The log has two halves, one in use at a time: when
+// it fills up, the sessions still muted are written into the other half and
+// one store to the head switches over, so a kill part way through leaves the
+// old half as it was.
+#define JOURNAL_FILE_NAME "AutoMuteJournal"
+#define JOURNAL_MAGIC 0x4C4E524A // "JRNL"
+#define JOURNAL_VERSION 2
+#define JOURNAL_CAPACITY 16384      // Records in each half
+#define JOURNAL_HALF_BIT 0x40000000 // Set in the head while the second half is in use
+
+struct JournalRecord
+{
+  ULONGLONG instanceHash;   // Hash of the session's instance identifier
+  ULONGLONG startTime;      // Identity of the session's process
+  DWORD processId;
+  float level;              // Volume a ducked session is restored to
+  DWORD muted;              // Muted or ducked by the engine, or given back
+  DWORD ducked;             // Ducked rather than muted
+  ULONGLONG check;          // JournalCheck of the fields above
+};
+
+struct MuteJournal
+{
+  DWORD magic;
+  DWORD version;
+  DWORD capacity;
+  volatile LONG head;       // JOURNAL_HALF_BIT for the half in use, and its record count
+  JournalRecord records[2][JOURNAL_CAPACITY];
+};
+
+// Declare and initialize globals
+HANDLE ghEvents[2];
+// Seats
+// Each interactive Windows session (the console, each remote desktop, each
+// user under fast user switching) is a seat with its own desktop, focus and
+// default audio endpoint, served by its own instance. Everything an instance
+// names carries its seat ID, so instances on different seats never share or
+// contend for an object.
+DWORD seatId = 0;
+char workEventName[SEAT_NAME_SIZE];
+char quitEventName[SEAT_NAME_SIZE];
+char controlPipeName[SEAT_NAME_SIZE];
+char statusMappingName[SEAT_NAME_SIZE];
+SessionStore sessionStore = {};
+vector<RetiredSession> retiredSessions;
+CRITICAL_SECTION hashmapCriticalSection;
+unordered_set<string_view> sessionIdSet;   // Views of instance IDs in sessionArena
+StringArena sessionArena = {};             // Metadata for the default endpoint's sessions
+SYNCHRONIZATION_BARRIER syncBarrier;
+LPSYNCHRONIZATION_BARRIER lpBarrier = &syncBarrier;
+volatile LONG focusSeqLock = 0; // Odd while a focus snapshot is being written
+FocusSnapshot focusSnapshot = {0, {0, 0}, NULL, 0, 0};
+bool daemonMode = false;
+bool metricsMode = false;
+DWORD stressSeconds = 0;       // Non-zero runs the stress harness instead of the hook
+DWORD stressPublishers = 0;    // Threads publishing focus alongside the stress harness
+volatile LONG64 stressPublishes = 0;   // Focus snapshots published by the harness and them
+GUID engineEventContext = {};  // Tags every change the engine makes, to tell its echoes apart
+bool duckMode = false;         // Lower background sessions instead of muting them
+float duckFraction = 0.0f;     // Fraction of its own volume a ducked session keeps
+volatile bool gameMode = false;   // A fullscreen window has focus; see SetGameMode
+bool desktopMode = false;      // Keep every app with a window on the visible desktop audible
+IVirtualDesktopManager * pDesktopManager = NULL;   // Used by the audio thread only
+bool keepAudibleMode = false;  // Leave the audible app alone while a silent app has focus
+bool filterTransient = true;   // Ignore focus changes to tooltips, menus and the like
+volatile LONG activationRequested = 0;   // Some process started producing audio
+CrossProcessPolicy crossProcessPolicy = CP_IGNORE;
+char followedAppName[MAX_PATH] = "";   // Executable file name, for CP_FOLLOW_APP
+volatile LONG refreshRequested = 0;
+DWORD mainThreadId = 0;
+EngineStats engineStats = {};
+HANDLE hStatusMapping = NULL;
+StatusBlock * pStatusBlock = NULL;
+char snapshotPath[MAX_PATH] = "";   // Empty when there is no snapshot
+HANDLE hSnapshotFile = INVALID_HANDLE_VALUE;
+HANDLE hSnapshotMapping = NULL;
+SessionSnapshot * pSnapshot = NULL;
+// Records left by the previous instance, by instance hash, until the sessions
+// found at startup have taken them over
+unordered_map<ULONGLONG, SnapshotRecord> previousSessions;
+char journalPath[MAX_PATH] = "";    // Empty when there is no journal
+HANDLE hJournalFile = INVALID_HANDLE_VALUE;
+HANDLE hJournalMapping = NULL;
+MuteJournal * pJournal = NULL;
+LONG journalLimit = JOURNAL_CAPACITY / 2;   // Records appended between compactions
+LONG journalBase = 0;          // Records the last compaction left in the half in use
+bool recoverMode = false;      // Undo the journal and exit instead of running
+
+
+// Focus/mute state machine
+// All of the decisions about when to apply mute changes are made here, instead of
+// being spread across WinEventProc, the queue drain loop and SwitchMuteStates.
+// The audio thread owns the state and feeds it events; each event is a single
+// lookup into a transition table which is generated at compile time from the
+// FocusTransition specializations below.
+enum FocusState : unsigned char
+{
+  FS_IDLE,              // Mute states match the focused process, nothing to do
+  FS_PENDING_DEBOUNCE,  // Focus changed, waiting for it to settle
+  FS_APPLYING,          // Mute changes are being applied
+  FS_PAUSED,            // Switching suspended, focus is still tracked
+  FS_STOPPED,           // Quit requested, absorbs all further events
+  FS_STATE_COUNT
+};
+
+const char * focusStateNames[FS_STATE_COUNT] =
+{
+  "idle", "pending-debounce", "applying", "paused", "stopped"
+};
+
+enum FocusEvent : unsigned char
+{
+  FE_FOCUS_CHANGED,
+  FE_DEBOUNCE_EXPIRED,
+  FE_APPLY_DONE,
+  FE_PAUSE,
+  FE_RESUME,
+  FE_QUIT,
+  FE_REFRESH,
+  FE_EVENT_COUNT
+};
+
+enum FocusAction : unsigned char
+{
+  FA_NONE,              // Nothing to do
+  FA_ARM_DEBOUNCE,      // (Re)start the debounce timer
+  FA_CANCEL_DEBOUNCE,   // Stop the debounce timer
+  FA_APPLY,             // Apply mute changes for the pending focus change
+  FA_REFRESH,           // Set the mute state of every session from the focus
+  FA_REJECT             // The event isn't valid in this state; refuse it
+};
+
+// Transition for a state/event pair. Every pair the engine handles is listed
+// below, including those it deliberately ignores; an unlisted pair leaves the
+// state unchanged and is rejected, so a command that can't be carried out is
+// refused rather than quietly dropped. Once stopped, everything is absorbed.
+template<FocusState S, FocusEvent E> struct FocusTransition
+{
+  static constexpr FocusState next = S;
+  static constexpr FocusAction action = FA_REJECT;
+};
+template<FocusEvent E> struct FocusTransition<FS_STOPPED, E>
+{
+  static constexpr FocusState next = FS_STOPPED;
+  static constexpr FocusAction action = FA_NONE;
+};
+#define FOCUS_TRANSITION(S, E, N, A) \
+  template<> struct FocusTransition<S, E> \
+  { \
+    static constexpr FocusState next = N; \
+    static constexpr FocusAction action = A; \
+  };
+FOCUS_TRANSITION(FS_IDLE,             FE_FOCUS_CHANGED,    FS_PENDING_DEBOUNCE, FA_ARM_DEBOUNCE)
+FOCUS_TRANSITION(FS_IDLE,             FE_DEBOUNCE_EXPIRED, FS_IDLE,             FA_NONE)
+FOCUS_TRANSITION(FS_IDLE,             FE_PAUSE,            FS_PAUSED,           FA_NONE)
+FOCUS_TRANSITION(FS_IDLE,             FE_RESUME,           FS_IDLE,             FA_NONE)
+FOCUS_TRANSITION(FS_IDLE,             FE_QUIT,             FS_STOPPED,          FA_NONE)
+FOCUS_TRANSITION(FS_IDLE,             FE_REFRESH,          FS_APPLYING,         FA_REFRESH)
+FOCUS_TRANSITION(FS_PENDING_DEBOUNCE, FE_FOCUS_CHANGED,    FS_PENDING_DEBOUNCE, FA_ARM_DEBOUNCE)
+FOCUS_TRANSITION(FS_PENDING_DEBOUNCE, FE_DEBOUNCE_EXPIRED, FS_APPLYING,         FA_APPLY)
+FOCUS_TRANSITION(FS_PENDING_DEBOUNCE, FE_PAUSE,            FS_PAUSED,           FA_CANCEL_DEBOUNCE)
+FOCUS_TRANSITION(FS_PENDING_DEBOUNCE, FE_RESUME,           FS_PENDING_DEBOUNCE, FA_NONE)
+FOCUS_TRANSITION(FS_PENDING_DEBOUNCE, FE_QUIT,             FS_STOPPED,          FA_CANCEL_DEBOUNCE)
+FOCUS_TRANSITION(FS_PENDING_DEBOUNCE, FE_REFRESH,          FS_APPLYING,         FA_REFRESH)
+FOCUS_TRANSITION(FS_APPLYING,         FE_APPLY_DONE,       FS_IDLE,             FA_NONE)
+FOCUS_TRANSITION(FS_APPLYING,         FE_QUIT,             FS_STOPPED,          FA_NONE)
+FOCUS_TRANSITION(FS_PAUSED,           FE_FOCUS_CHANGED,    FS_PAUSED,           FA_NONE)
+FOCUS_TRANSITION(FS_PAUSED,           FE_DEBOUNCE_EXPIRED, FS_PAUSED,           FA_NONE)
+FOCUS_TRANSITION(FS_PAUSED,           FE_PAUSE,            FS_PAUSED,           FA_NONE)
+FOCUS_TRANSITION(FS_PAUSED,           FE_RESUME,           FS_PENDING_DEBOUNCE, FA_ARM_DEBOUNCE)
+FOCUS_TRANSITION(FS_PAUSED,           FE_QUIT,             FS_STOPPED,          FA_NONE)
+#undef FOCUS_TRANSITION
+
+struct FocusTransitionEntry
+{
+  FocusState next;
+  FocusAction action;
+};
+
+template<size_t... I>
+constexpr array<FocusTransitionEntry, sizeof...(I)> MakeFocusTransitionTable(index_sequence<I...>)
+{
+  return {{ {
+    FocusTransition<(FocusState) (I / FE_EVENT_COUNT), (FocusEvent) (I % FE_EVENT_COUNT)>::next,
+    FocusTransition<(FocusState) (I / FE_EVENT_COUNT), (FocusEvent) (I % FE_EVENT_COUNT)>::action
+  }... }};
+}
+
+constexpr auto focusTransitionTable =
+  MakeFocusTransitionTable(make_index_sequence<FS_STATE_COUNT * FE_EVENT_COUNT>());
+
+constexpr FocusTransitionEntry LookupFocusTransition(FocusState state, FocusEvent event)
+{
+  return focusTransitionTable[state * FE_EVENT_COUNT + event];
+}
+
+// The transitions the audio thread relies on, checked when compiling
+static_assert(LookupFocusTransition(FS_IDLE, FE_FOCUS_CHANGED).next == FS_PENDING_DEBOUNCE, "focus must arm debounce");
+static_assert(LookupFocusTransition(FS_PENDING_DEBOUNCE, FE_FOCUS_CHANGED).action == FA_ARM_DEBOUNCE, "focus must restart debounce");
+static_assert(LookupFocusTransition(FS_PENDING_DEBOUNCE, FE_DEBOUNCE_EXPIRED).action == FA_APPLY, "expiry must apply");
+static_assert(LookupFocusTransition(FS_APPLYING, FE_APPLY_DONE).next == FS_IDLE, "apply must return to idle");
+static_assert(LookupFocusTransition(FS_PAUSED, FE_FOCUS_CHANGED).next == FS_PAUSED, "paused must ignore focus");
+static_assert(LookupFocusTransition(FS_PAUSED, FE_RESUME).action == FA_ARM_DEBOUNCE, "resume must reapply focus");
+static_assert(LookupFocusTransition(FS_IDLE, FE_DEBOUNCE_EXPIRED).action == FA_NONE, "stale expiry must be ignored");
+static_assert(LookupFocusTransition(FS_STOPPED, FE_RESUME).next == FS_STOPPED, "stopped must absorb events");
+static_assert(LookupFocusTransition(FS_PENDING_DEBOUNCE, FE_REFRESH).action == FA_REFRESH, "refresh must not wait for debounce");
+static_assert(LookupFocusTransition(FS_PAUSED, FE_REFRESH).action == FA_REJECT, "paused must refuse a refresh, not drop it");
+static_assert(LookupFocusTransition(FS_PAUSED, FE_REFRESH).next == FS_PAUSED, "a refused refresh must leave the state as it was");
+static_assert(LookupFocusTransition(FS_APPLYING, FE_FOCUS_CHANGED).action == FA_REJECT, "applying runs to completion");
+static_assert(LookupFocusTransition(FS_IDLE, FE_APPLY_DONE).action == FA_REJECT, "only an apply can finish");
+
+// Set by the trace replay to record every event dispatched, so the transition
+// table can be timed on its own against a real sequence of events
+vector<FocusEvent> * pFocusEventLog = NULL;
+
+// DispatchFocusEvent
+// Advances the state machine by one event and returns the action the caller must
+// perform. This is a table lookup with no branches on the current state.
+inline FocusAction DispatchFocusEvent(FocusState * pState, FocusEvent event)
+{
+  if(pFocusEventLog) { pFocusEventLog -> push_back(event); }
+  FocusTransitionEntry t = focusTransitionTable[*pState * FE_EVENT_COUNT + event];
+  *pState = t.next;
+  return t.action;
+}
+
+// Engine clock
+// Every timer and timestamp in the engine goes through engineClock, so that the
+// simulated clock can stand in for the real one and timed policies run faster
+// than real time. Milliseconds are for timers, ticks for latency measurements.
+#define NO_DEADLINE MAXULONGLONG
+
+class EngineClock
+{
+public:
+    virtual ULONGLONG NowMs() = 0;
+    virtual LONGLONG NowTicks() = 0;
+    virtual double TicksPerSecond() = 0;
+
+    // Waits until one of the handles is signalled, returning its index as
+    // WaitForMultipleObjects would, or until the clock reaches deadlineMs,
+    // returning WAIT_TIMEOUT.
+    virtual DWORD Wait(DWORD count, const HANDLE * handles, ULONGLONG deadlineMs) = 0;
+
+    // Lets time pass on the calling thread
+    virtual void Sleep(DWORD ms) = 0;
+
+    // Converts a 32-bit GetTickCount-style timestamp, such as the dwmsEventTime
+    // handed to WinEventProc, to engine milliseconds, assuming it is in the past
+    ULONGLONG FromEventTime(DWORD eventTime)
+    {
+      ULONGLONG now = NowMs();
+      ULONGLONG expanded = (now & ~0xFFFFFFFFULL) | eventTime;
+      if(expanded > now && expanded >= 0x100000000ULL) { expanded -= 0x100000000ULL; }
+      return expanded;
+    }
+};
+
+class CRealClock : public EngineClock
+{
+    double _ticksPerSecond;
+
+public:
+    CRealClock()
+    {
+      LARGE_INTEGER frequency;
+      QueryPerformanceFrequency(&frequency);
+      _ticksPerSecond = (double) frequency.QuadPart;
+    }
+
+    ULONGLONG NowMs() { return GetTickCount64(); }
+
+    LONGLONG NowTicks()
+    {
+      LARGE_INTEGER ticks;
+      QueryPerformanceCounter(&ticks);
+      return ticks.QuadPart;
+    }
+
+    double TicksPerSecond() { return _ticksPerSecond; }
+
+    DWORD Wait(DWORD count, const HANDLE * handles, ULONGLONG deadlineMs)
+    {
+      DWORD timeout = INFINITE;
+      if(deadlineMs != NO_DEADLINE)
+      {
+        ULONGLONG now = GetTickCount64();
+        timeout = now >= deadlineMs ? 0 : (DWORD) (deadlineMs - now);
+      }
+      return WaitForMultipleObjects(count, handles, false, timeout);
+    }
+
+    void Sleep(DWORD ms) { ::Sleep(ms); }
+};
+
+// Simulated clock
+// Time only moves when a driver calls Advance (or Sleep). A waiter whose deadline
+// has been reached times out at once; otherwise it blocks until a handle is
+// signalled or time is advanced, without ever sleeping in real time. Ticks are
+// microseconds of simulated time.
+class CSimulatedClock : public EngineClock
+{
+    volatile LONG64 _nowMs;
+    // For Settle: the waiter's deadline, how many settles were requested, and
+    // the newest request the waiter had caught up with when it last blocked
+    volatile LONG64 _waitDeadline;
+    volatile LONG64 _settleRequests;
+    volatile LONG64 _settled;
+    HANDLE _hAdvanced;
+    HANDLE _hIdle;
+
+public:
+    CSimulatedClock() :
+        _nowMs(0),
+        _waitDeadline((LONG64) NO_DEADLINE),
+        _settleRequests(0),
+        _settled(0),
+        _hAdvanced(CreateEvent(NULL, false, false, NULL)),
+        _hIdle(CreateEvent(NULL, false, false, NULL))
+    {
+    }
+
+    ~CSimulatedClock()
+    {
+      if(_hAdvanced) { CloseHandle(_hAdvanced); }
+      if(_hIdle) { CloseHandle(_hIdle); }
+    }
+
+    ULONGLONG NowMs() { return (ULONGLONG) ReadAcquire64(&_nowMs); }
+    LONGLONG NowTicks() { return ReadAcquire64(&_nowMs) * 1000; }
+    double TicksPerSecond() { return 1000000.0; }
+
+    void Advance(DWORD ms)
+    {
+      InterlockedAdd64(&_nowMs, ms);
+      SetEvent(_hAdvanced);
+    }
+
+    // Blocks until the waiting thread has handled every handle signaled and
+    // every advance made before the call, and is waiting again
+    void Settle()
+    {
+      LONG64 request = InterlockedIncrement64(&_settleRequests);
+      SetEvent(_hAdvanced);
+      do { WaitForSingleObject(_hIdle, INFINITE); }
+      while(ReadAcquire64(&_settled) < request);
+    }
+
+    // Advances to targetMs one deadline at a time, so that each timeout is
+    // handled at the simulated time it was due rather than at targetMs
+    void AdvanceTo(ULONGLONG targetMs)
+    {
+      Settle();
+      for(;;)
+      {
+        ULONGLONG deadlineMs = (ULONGLONG) ReadAcquire64(&_waitDeadline);
+        ULONGLONG stepMs = deadlineMs < targetMs ? deadlineMs : targetMs;
+        if(stepMs <= NowMs()) { break; }
+        Advance((DWORD) (stepMs - NowMs()));
+        Settle();
+      }
+    }
+
+    DWORD Wait(DWORD count, const HANDLE * handles, ULONGLONG deadlineMs)
+    {
+      HANDLE waitHandles[MAXIMUM_WAIT_OBJECTS];
+      memcpy(waitHandles, handles, count * sizeof(HANDLE));
+      waitHandles[count] = _hAdvanced;
+      for(;;)
+      {
+        if(deadlineMs != NO_DEADLINE && NowMs() >= deadlineMs) { return WAIT_TIMEOUT; }
+        // Only idle once nothing signaled before the newest settle request is
+        // left, so Settle can't return while there is work pending
+        LONG64 request = ReadAcquire64(&_settleRequests);
+        DWORD result = WaitForMultipleObjects(count, waitHandles, false, 0);
+        if(result != WAIT_TIMEOUT) { return result; }
+        WriteRelease64(&_waitDeadline, (LONG64) deadlineMs);
+        WriteRelease64(&_settled, request);
+        SetEvent(_hIdle);
+        result = WaitForMultipleObjects(count + 1, waitHandles, false, INFINITE);
+        if(result != WAIT_OBJECT_0 + count) { return result; }
+      }
+    }
+
+    void Sleep(DWORD ms) { Advance(ms); }
+};
+
+CRealClock realClock;
+CSimulatedClock simulatedClock;
+EngineClock * engineClock = &realClock;
+
+// EventLog
+// printf for the messages logged per event, which game mode silences
+void EventLog(const char * format, ...)
+{
+  if(gameMode) { return; }
+  va_list args;
+  va_start(args, format);
+  vprintf(format, args);
+  va_end(args);
+}
+
+// Process identity cache
+// Resolving an identity takes an OpenProcess and a GetProcessTimes, so each one
+// is resolved once and cached by process ID. The cache holds a handle to each
+// process and a thread pool wait on it, which drops the entry the moment the
+// process exits, before its ID can be reused.
+struct CachedProcess
+{
+  ULONGLONG startTime;
+  HANDLE hProcess;
+  HANDLE hWait;
+  bool followedApp;   // Runs followedAppName
+};
+
+unordered_map<DWORD, CachedProcess> processCache;
+SRWLOCK processCacheLock = SRWLOCK_INIT;
+bool standInProcesses = false;   // Process IDs name stand-ins, not real processes
+
+// The start time a stand-in process is given, so that a replay or stress run
+// resolves the same identities on every machine without opening anything
+ULONGLONG StandInStartTime(DWORD processId)
+{
+  return (ULONGLONG) processId * 10000000ULL;
+}
+
+VOID CALLBACK OnProcessExit(PVOID pContext, BOOLEAN timedOut)
+{
+  DWORD processId = (DWORD) (ULONG_PTR) pContext;
+  CachedProcess entry = {0, NULL, NULL, false};
+  AcquireSRWLockExclusive(&processCacheLock);
+  auto p = processCache.find(processId);
+  if(p != processCache.end())
+  {
+    entry = p -> second;
+    processCache.erase(p);
+  }
+  ReleaseSRWLockExclusive(&processCacheLock);
+
+  // UnregisterWait doesn't block, so it may be called from the wait's own callback
+  if(entry.hWait) { UnregisterWait(entry.hWait); }
+  if(entry.hProcess) { CloseHandle(entry.hProcess); }
+}
+
+// ResolveProcessIdentity
+// Returns the identity of the process currently using processId. Processes
+// that can't be opened get a start time of 0 and aren't cached. Stand-ins are
+// never opened; see StandInStartTime.
+ProcessIdentity ResolveProcessIdentity(DWORD processId)
+{
+  ProcessIdentity identity = {processId, 0};
+  if(!processId) { return identity; }
+  if(standInProcesses)
+  {
+    identity.startTime = StandInStartTime(processId);
+    return identity;
+  }
+
+  AcquireSRWLockShared(&processCacheLock);
+  auto p = processCache.find(processId);
+  bool found = p != processCache.end();
+  if(found) { identity.startTime = p -> second.startTime; }
+  ReleaseSRWLockShared(&processCacheLock);
+  if(found) { return identity; }
+
+  HANDLE hProcess = OpenProcess(PROCESS_QUERY_LIMITED_INFORMATION | SYNCHRONIZE, false, processId);
+  if(!hProcess) { return identity; }
+  FILETIME creation, exit, kernel, user;
+  if(!GetProcessTimes(hProcess, &creation, &exit, &kernel, &user))
+  {
+    CloseHandle(hProcess);
+    return identity;
+  }
+  identity.startTime = ((ULONGLONG) creation.dwHighDateTime << 32) | creation.dwLowDateTime;
+
+  // The image name is only needed to match the followed app, and never changes
+  bool followedApp = false;
+  if(crossProcessPolicy == CP_FOLLOW_APP)
+  {
+    char imagePath[MAX_PATH];
+    DWORD length = MAX_PATH;
+    if(QueryFullProcessImageNameA(hProcess, 0, imagePath, &length))
+    {
+      const char * imageName = strrchr(imagePath, '\\');
+      followedApp = !_stricmp(imageName ? imageName + 1 : imagePath, followedAppName);
+    }
+  }
+
+  AcquireSRWLockExclusive(&processCacheLock);
+  if(processCache.count(processId))
+  {
+    // Another thread resolved it first
+    ReleaseSRWLockExclusive(&processCacheLock);
+    CloseHandle(hProcess);
+    return identity;
+  }
+  CachedProcess entry = {identity.startTime, hProcess, NULL, followedApp};
+  if(RegisterWaitForSingleObject(&entry.hWait, hProcess, OnProcessExit,
+    (PVOID) (ULONG_PTR) processId, INFINITE, WT_EXECUTEONLYONCE))
+  {
+    processCache[processId] = entry;
+    hProcess = NULL;
+  }
+  ReleaseSRWLockExclusive(&processCacheLock);
+  if(hProcess) { CloseHandle(hProcess); }
+  return identity;
+}
+
+// Whether a process runs followedAppName. Only cached processes can match.
+bool IsFollowedApp(ProcessIdentity process)
+{
+  AcquireSRWLockShared(&processCacheLock);
+  auto p = processCache.find(process.processId);
+  bool followed = p != processCache.end() && p -> second.startTime == process.startTime && p -> second.followedApp;
+  ReleaseSRWLockShared(&processCacheLock);
+  return followed;
+}
+
+// ClearProcessCache
+// Drops every cached process. Waits are unregistered outside the lock and
+// with completion, since a callback that is already running takes the lock.
+void ClearProcessCache()
+{
+  unordered_map<DWORD, CachedProcess> entries;
+  AcquireSRWLockExclusive(&processCacheLock);
+  entries.swap(processCache);
+  ReleaseSRWLockExclusive(&processCacheLock);
+
+  for(auto p = entries.begin(); p != entries.end(); ++p)
+  {
+    UnregisterWaitEx(p -> second.hWait, INVALID_HANDLE_VALUE);
+    CloseHandle(p -> second.hProcess);
+  }
+}
+
+// PublishFocus
+// Makes a new focus snapshot visible to readers, using focusSeqLock as a seqlock.
+// Writers claim the lock by moving it from even to odd, so any number of threads
+// may publish; each publish gets the next sequence number, in the order in which
+// the writers claimed the lock, and returns it.
+LONG64 PublishFocus(ProcessIdentity process, HWND hwnd, ULONGLONG eventTime, bool fullscreen)
+{
+  LONG seq;
+  do
+  {
+    seq = ReadAcquire(&focusSeqLock);
+  }
+  while((seq & 1) || InterlockedCompareExchange(&focusSeqLock, seq + 1, seq) != seq);
+
+  LONG64 sequence = ++focusSnapshot.sequence;
+  focusSnapshot.process = process;
+  focusSnapshot.hwnd = hwnd;
+  focusSnapshot.eventTime = eventTime;
+  focusSnapshot.publishTicks = engineClock -> NowTicks();
+  focusSnapshot.fullscreen = fullscreen;
+
+  // Full barrier, so the snapshot is visible before the lock becomes even again
+  InterlockedExchange(&focusSeqLock, seq + 2);
+  return sequence;
+}
+
+// ReadFocus
+// Copies the newest focus snapshot into *pSnapshot without taking any locks,
+// retrying if a writer was active while the copy was being made.
+void ReadFocus(FocusSnapshot * pSnapshot)
+{
+  LONG seqBefore, seqAfter;
+  do
+  {
+    seqBefore = ReadAcquire(&focusSeqLock);
+    pSnapshot -> sequence = focusSnapshot.sequence;
+    pSnapshot -> process = focusSnapshot.process;
+    pSnapshot -> hwnd = focusSnapshot.hwnd;
+    pSnapshot -> eventTime = focusSnapshot.eventTime;
+    pSnapshot -> publishTicks = focusSnapshot.publishTicks;
+    pSnapshot -> fullscreen = focusSnapshot.fullscreen;
+    MemoryBarrier();
+    seqAfter = ReadAcquire(&focusSeqLock);
+  }
+  while((seqBefore & 1) || seqBefore != seqAfter);
+}
+
+// Records the time elapsed since startTicks in the histogram for a stage
+void ObserveLatency(LatencyStage stage, LONGLONG startTicks)
+{
+  double seconds = (engineClock -> NowTicks() - startTicks) / engineClock -> TicksPerSecond();
+  LatencyHistogram * pHistogram = &engineStats.latency[stage];
+  for(int i = 0; i < LATENCY_BUCKET_COUNT; i++)
+  {
+    if(seconds <= latencyBucketBounds[i]) { pHistogram -> buckets[i]++; }
+  }
+  pHistogram -> count++;
+  pHistogram -> sum += seconds;
+}
+
+// Estimates the time the window cache has saved: each hit would otherwise have
+// cost what a miss costs on average
+double WindowLookupSavedSeconds()
+{
+  if(!engineStats.windowCacheMisses) { return 0.0; }
+  return (double) engineStats.windowLookupTicks / engineStats.windowCacheMisses
+    * engineStats.windowCacheHits / engineClock -> TicksPerSecond();
+}
+
+char * ArenaAllocate(StringArena * pArena, size_t size)
+{
+  if(size > ARENA_BLOCK_SIZE)
+  {
+    // Oversized strings get a block of their own, which is then full
+    pArena -> blocks.push_back(new char[size]);
+    pArena -> blockUsed = ARENA_BLOCK_SIZE;
+    pArena -> totalBytes += size;
+    return pArena -> blocks.back();
+  }
+  if(pArena -> blocks.empty() || pArena -> blockUsed + size > ARENA_BLOCK_SIZE)
+  {
+    pArena -> blocks.push_back(new char[ARENA_BLOCK_SIZE]);
+    pArena -> blockUsed = 0;
+  }
+  char * p = pArena -> blocks.back() + pArena -> blockUsed;
+  pArena -> blockUsed += size;
+  pArena -> totalBytes += size;
+  return p;
+}
+
+// Converts a wide string to UTF-8 in the arena. Empty strings, like missing
+// ones, take no space, as with ArenaCopy.
+ArenaString ArenaCopyWide(StringArena * pArena, LPCWSTR source)
+{
+  ArenaString result = {"", 0};
+  int size = source ? WideCharToMultiByte(CP_UTF8, 0, source, -1, NULL, 0, NULL, NULL) : 0;
+  if(size <= 1) { return result; }
+  char * p = ArenaAllocate(pArena, size);
+  WideCharToMultiByte(CP_UTF8, 0, source, -1, p, size, NULL, NULL);
+  result.data = p;
+  result.length = (DWORD) size - 1;
+  return result;
+}
+
+ArenaString ArenaCopy(StringArena * pArena, ArenaString source)
+{
+  ArenaString result = {"", 0};
+  if(!source.length) { return result; }
+  char * p = ArenaAllocate(pArena, source.length + 1);
+  memcpy(p, source.data, source.length + 1);
+  result.data = p;
+  result.length = source.length;
+  return result;
+}
+
+ArenaMark GetArenaMark(StringArena * pArena)
+{
+  ArenaMark mark = {pArena -> blocks.size(), pArena -> blockUsed, pArena -> totalBytes};
+  return mark;
+}
+
+void ArenaRollback(StringArena * pArena, ArenaMark mark)
+{
+  while(pArena -> blocks.size() > mark.blockCount)
+  {
+    delete[] pArena -> blocks.back();
+    pArena -> blocks.pop_back();
+  }
+  pArena -> blockUsed = mark.blockUsed;
+  pArena -> totalBytes = mark.totalBytes;
+}
+
+void ArenaReset(StringArena * pArena)
+{
+  for(auto p = pArena -> blocks.begin(); p != pArena -> blocks.end(); ++p) { delete[] *p; }
+  pArena -> blocks.clear();
+  pArena -> blockUsed = 0;
+  pArena -> totalBytes = 0;
+  pArena -> liveBytes = 0;
+}
+
+// Arena bytes taken by a string: none when it is empty
+inline size_t ArenaStringBytes(ArenaString text)
+{
+  return text.length ? text.length + 1 : 0;
+}
+
+inline size_t MetadataBytes(const SessionMetadata & metadata)
+{
+  return ArenaStringBytes(metadata.displayName) + ArenaStringBytes(metadata.sessionId)
+    + ArenaStringBytes(metadata.instanceId);
+}
+
+// FNV-1a, for hashes that must not change between builds
+inline ULONGLONG HashBytes(const void * pData, size_t size, ULONGLONG hash = 14695981039346656037ULL)
+{
+  const BYTE * pBytes = (const BYTE *) pData;
+  for(size_t i = 0; i < size; i++) { hash = (hash ^ pBytes[i]) * 1099511628211ULL; }
+  return hash;
+}
+
+inline ULONGLONG InstanceHash(string_view instanceId)
+{
+  // 0 marks a free record
+  ULONGLONG hash = HashBytes(instanceId.data(), instanceId.size());
+  return hash ? hash : 1;
+}
+
+inline ULONGLONG SnapshotCheck(const SnapshotRecord & record)
+{
+  ULONGLONG hash = HashBytes(&record.instanceHash, sizeof(record.instanceHash));
+  hash = HashBytes(&record.startTime, sizeof(record.startTime), hash);
+  hash = HashBytes(&record.processId, sizeof(record.processId), hash);
+  hash = HashBytes(&record.level, sizeof(record.level), hash);
+  return HashBytes(&record.flags, sizeof(record.flags), hash);
+}
+
+// SnapshotSession
+// Writes the snapshot record of the session in slot, or clears it if the slot
+// is free. The caller must hold hashmapCriticalSection.
+void SnapshotSession(DWORD slot)
+{
+  if(!pSnapshot || slot >= SNAPSHOT_CAPACITY) { return; }
+  SessionStore * st = &sessionStore;
+  SnapshotRecord record;
+  memset(&record, 0, sizeof(record));
+  if(st -> flags[slot] & SF_IN_USE)
+  {
+    record.instanceHash = InstanceHash(st -> metadata[slot].instanceId.View());
+    record.startTime = st -> processes[slot].startTime;
+    record.processId = st -> processes[slot].processId;
+    record.level = st -> levels[slot];
+    record.flags = st -> flags[slot] & (SF_MUTED | SF_OVERRIDE);
+    record.check = SnapshotCheck(record);
+  }
+  pSnapshot -> records[slot] = record;
+}
+
+// OpenSnapshot
+// Maps the snapshot file, creating it if needed, and keeps the decisions the
+// previous instance recorded in previousSessions if it is valid and was written
+// in the same mode. The records are then cleared for this instance.
+void OpenSnapshot()
+{
+  if(!snapshotPath[0]) { return; }
+  hSnapshotFile = CreateFileA(snapshotPath, GENERIC_READ | GENERIC_WRITE, 0, NULL,
+    OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+  if(hSnapshotFile == INVALID_HANDLE_VALUE)
+  {
+    #if LOGGING
+    printf("ERROR: CreateFile for the session snapshot failed with error code %ld\n", GetLastError());
+    #endif
+    return;
+  }
+  hSnapshotMapping = CreateFileMappingA(hSnapshotFile, NULL, PAGE_READWRITE, 0, sizeof(SessionSnapshot), NULL);
+  if(hSnapshotMapping)
+  {
+    pSnapshot = (SessionSnapshot *) MapViewOfFile(hSnapshotMapping, FILE_MAP_WRITE, 0, 0, sizeof(SessionSnapshot));
+  }
+  if(!pSnapshot)
+  {
+    #if LOGGING
+    printf("ERROR: Mapping the session snapshot failed with error code %ld\n", GetLastError());
+    #endif
+    if(hSnapshotMapping) { CloseHandle(hSnapshotMapping); }
+    CloseHandle(hSnapshotFile);
+    hSnapshotMapping = NULL;
+    hSnapshotFile = INVALID_HANDLE_VALUE;
+    return;
+  }
+
+  // Recovery gives back everything, so it takes over nothing
+  if(!recoverMode && pSnapshot -> magic == SNAPSHOT_MAGIC && pSnapshot -> version == SNAPSHOT_VERSION
+    && pSnapshot -> capacity == SNAPSHOT_CAPACITY && pSnapshot -> duckMode == (DWORD) duckMode)
+  {
+    for(DWORD slot = 0; slot < SNAPSHOT_CAPACITY; slot++)
+    {
+      const SnapshotRecord & record = pSnapshot -> records[slot];
+      if(record.instanceHash && record.flags && record.check == SnapshotCheck(record))
+      {
+        previousSessions[record.instanceHash] = record;
+      }
+    }
+  }
+  memset(pSnapshot, 0, sizeof(SessionSnapshot));
+  pSnapshot -> version = SNAPSHOT_VERSION;
+  pSnapshot -> capacity = SNAPSHOT_CAPACITY;
+  pSnapshot -> duckMode = duckMode;
+  pSnapshot -> magic = SNAPSHOT_MAGIC;
+}
+
+// Unmaps the snapshot, leaving the records as they are for the next instance
+void CloseSnapshot()
+{
+  if(!pSnapshot) { return; }
+  UnmapViewOfFile(pSnapshot);
+  CloseHandle(hSnapshotMapping);
+  CloseHandle(hSnapshotFile);
+  pSnapshot = NULL;
+  hSnapshotMapping = NULL;
+  hSnapshotFile = INVALID_HANDLE_VALUE;
+}
+
+// RestoreSessionState
+// Takes over the decision the previous instance recorded for the session in
+// slot, if it recorded one for the same session of the same process: a session
+// it muted is known to be muted, so it is only unmuted if focus calls for it,
+// and a ducked session keeps its own volume rather than the ducked one read
+// back. The caller must hold hashmapCriticalSection.
+void RestoreSessionState(DWORD slot)
+{
+  if(previousSessions.empty()) { return; }
+  SessionStore * st = &sessionStore;
+  auto entry = previousSessions.find(InstanceHash(st -> metadata[slot].instanceId.View()));
+  if(entry == previousSessions.end()) { return; }
+  const SnapshotRecord & record = entry -> second;
+  if(record.processId == st -> processes[slot].processId && record.startTime == st -> processes[slot].startTime)
+  {
+    if(record.flags & SF_MUTED) { st -> mutedCount++; }
+    if(record.flags & SF_OVERRIDE) { st -> overrideCount++; }
+    st -> flags[slot] |= (BYTE) (record.flags & (SF_MUTED | SF_OVERRIDE));
+    st -> levels[slot] = record.level;
+    engineStats.sessionsRestored++;
+  }
+  previousSessions.erase(entry);
+}
+
+// Ends the restore once the sessions found at startup have been added. Returns
+// whether any of them took over a decision from the previous instance.
+bool EndSnapshotRestore()
+{
+  EnterCriticalSection(&hashmapCriticalSection);
+  previousSessions.clear();
+  bool warm = engineStats.sessionsRestored != 0;
+  LeaveCriticalSection(&hashmapCriticalSection);
+  return warm;
+}
+
+inline ULONGLONG JournalCheck(const JournalRecord & record)
+{
+  ULONGLONG hash = HashBytes(&record.instanceHash, sizeof(record.instanceHash));
+  hash = HashBytes(&record.startTime, sizeof(record.startTime), hash);
+  hash = HashBytes(&record.processId, sizeof(record.processId), hash);
+  hash = HashBytes(&record.level, sizeof(record.level), hash);
+  hash = HashBytes(&record.muted, sizeof(record.muted), hash);
+  return HashBytes(&record.ducked, sizeof(record.ducked), hash);
+}
+
+inline LONG JournalHalf(LONG head) { return (head & JOURNAL_HALF_BIT) ? 1 : 0; }
+inline LONG JournalCount(LONG head) { return head & ~JOURNAL_HALF_BIT; }
+
+// Fills in the journal record at index of half for the session in slot
+void WriteJournalRecord(LONG half, LONG index, DWORD slot, bool muted)
+{
+  SessionStore * st = &sessionStore;
+  JournalRecord record;
+  memset(&record, 0, sizeof(record));
+  record.instanceHash = InstanceHash(st -> metadata[slot].instanceId.View());
+  record.startTime = st -> processes[slot].startTime;
+  record.processId = st -> processes[slot].processId;
+  record.level = st -> levels[slot];
+  record.muted = muted;
+  record.ducked = duckMode;
+  record.check = JournalCheck(record);
+  pJournal -> records[half][index] = record;
+}
+
+// CompactJournal
+// Rewrites the journal with one record per session the engine has muted, into
+// the half not in use, then switches to it. Until the head is stored the old
+// half is the journal, untouched, so a kill at any point leaves one or the
+// other whole. The caller must hold hashmapCriticalSection.
+void CompactJournal()
+{
+  if(!pJournal) { return; }
+  LONG half = 1 - JournalHalf(pJournal -> head);
+  LONG count = 0;
+  for(DWORD slot = 0; slot < sessionStore.flags.size(); slot++)
+  {
+    BYTE * pFlags = &sessionStore.flags[slot];
+    if((*pFlags & SF_MUTED) && count < JOURNAL_CAPACITY)
+    {
+      WriteJournalRecord(half, count++, slot, true);
+      *pFlags |= SF_JOURNALLED;
+    }
+    else { *pFlags &= ~SF_JOURNALLED; }
+  }
+  WriteRelease(&pJournal -> head, (half ? JOURNAL_HALF_BIT : 0) | count);
+  journalBase = count;
+  engineStats.journalCompactions++;
+}
+
+// AppendJournal
+// Logs that the engine is muting the session in slot, or gave it back, unless
+// the journal already has it so. The journal is compacted first once
+// journalLimit records have been appended since it last was, so each append
+// pays a bounded share of compacting however many sessions are muted. A full
+// half forces it sooner only with more sessions muted than a half holds, less
+// journalLimit. The caller must hold hashmapCriticalSection.
+void AppendJournal(DWORD slot, bool muted)
+{
+  if(!pJournal) { return; }
+  if(!(sessionStore.flags[slot] & SF_JOURNALLED) == !muted) { return; }
+  LONG count = JournalCount(pJournal -> head);
+  if(count >= journalBase + journalLimit || count >= JOURNAL_CAPACITY) { CompactJournal(); }
+  LONG head = pJournal -> head;
+  // Still full only if more sessions are muted than a half holds
+  if(JournalCount(head) >= JOURNAL_CAPACITY) { return; }
+  WriteJournalRecord(JournalHalf(head), JournalCount(head), slot, muted);
+  WriteRelease(&pJournal -> head, head + 1);
+  if(muted) { sessionStore.flags[slot] |= SF_JOURNALLED; }
+  else { sessionStore.flags[slot] &= ~SF_JOURNALLED; }
+}
+
+// OpenJournal
+// Maps the journal file, creating it if needed. A journal that isn't valid is
+// started afresh; otherwise its records are kept for UndoJournal.
+void OpenJournal()
+{
+  if(!journalPath[0]) { return; }
+  hJournalFile = CreateFileA(journalPath, GENERIC_READ | GENERIC_WRITE, 0, NULL,
+    OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+  if(hJournalFile == INVALID_HANDLE_VALUE)
+  {
+    #if LOGGING
+    printf("ERROR: CreateFile for the mute journal failed with error code %ld\n", GetLastError());
+    #endif
+    return;
+  }
+  hJournalMapping = CreateFileMappingA(hJournalFile, NULL, PAGE_READWRITE, 0, sizeof(MuteJournal), NULL);
+  if(hJournalMapping)
+  {
+    pJournal = (MuteJournal *) MapViewOfFile(hJournalMapping, FILE_MAP_WRITE, 0, 0, sizeof(MuteJournal));
+  }
+  if(!pJournal)
+  {
+    #if LOGGING
+    printf("ERROR: Mapping the mute journal failed with error code %ld\n", GetLastError());
+    #endif
+    if(hJournalMapping) { CloseHandle(hJournalMapping); }
+    CloseHandle(hJournalFile);
+    hJournalMapping = NULL;
+    hJournalFile = INVALID_HANDLE_VALUE;
+    return;
+  }
+  if(pJournal -> magic != JOURNAL_MAGIC || pJournal -> version != JOURNAL_VERSION
+    || pJournal -> capacity != JOURNAL_CAPACITY || pJournal -> head < 0
+    || JournalCount(pJournal -> head) > JOURNAL_CAPACITY)
+  {
+    pJournal -> head = 0;
+    pJournal -> version = JOURNAL_VERSION;
+    pJournal -> capacity = JOURNAL_CAPACITY;
+    pJournal -> magic = JOURNAL_MAGIC;
+  }
+  journalBase = JournalCount(pJournal -> head);
+}
+
+// Unmaps the journal, leaving its records for the next instance
+void CloseJournal()
+{
+  if(!pJournal) { return; }
+  UnmapViewOfFile(pJournal);
+  CloseHandle(hJournalMapping);
+  CloseHandle(hJournalFile);
+  pJournal = NULL;
+  hJournalMapping = NULL;
+  hJournalFile = INVALID_HANDLE_VALUE;
+}
+
+// StoreAddSession
+// Takes a free slot, or appends one, for a new session and indexes it by process.
+// Adds a reference to pSession and takes over the caller's reference to pVolume.
+// The metadata must already be in sessionArena. Returns the slot. The caller must hold hashmapCriticalSection.
+DWORD StoreAddSession(ProcessIdentity process, BYTE sessionFlags, IAudioSessionControl2 * pSession, ISimpleAudioVolume * pVolume, const GUID & grouping, const SessionMetadata & metadata)
+{
+  SessionStore * st = &sessionStore;
+  DWORD slot;
+  if(!st -> freeSlots.empty())
+  {
+    slot = st -> freeSlots.back();
+    st -> freeSlots.pop_back();
+  }
+  else
+  {
+    slot = (DWORD) st -> flags.size();
+    st -> processes.push_back(noProcess);
+    st -> windows.push_back(NULL);
+    st -> groupings.push_back(GUID_NULL);
+    st -> levels.push_back(1.0f);
+    st -> sessions.push_back(NULL);
+    st -> volumes.push_back(NULL);
+    st -> sinks.push_back(NULL);
+    st -> flags.push_back(0);
+    st -> generations.push_back(0);
+    st -> metadata.push_back(SessionMetadata());
+  }
+  st -> processes[slot] = process;
+  st -> sessions[slot] = pSession;
+  pSession -> AddRef();
+  st -> volumes[slot] = pVolume;
+  st -> sinks[slot] = NULL;
+  bool crossProcess = (sessionFlags & SF_CROSS_PROCESS) != 0;
+  st -> flags[slot] = SF_IN_USE | (sessionFlags & (SF_CROSS_PROCESS | SF_ACTIVE));
+  st -> generations[slot]++;
+  st -> metadata[slot] = metadata;
+  sessionArena.liveBytes += MetadataBytes(metadata);
+  if(crossProcess) { st -> crossProcess.Add(slot); }
+  else
+  {
+    st -> byProcess[process].Add(slot);
+    if(sessionFlags & SF_ACTIVE) { st -> activeByProcess[process]++; }
+  }
+  // A cross-process session plays for no window in particular
+  auto last = crossProcess ? st -> lastWindows.end() : st -> lastWindows.find(process);
+  st -> windows[slot] = last == st -> lastWindows.end() ? NULL : last -> second;
+  if(st -> windows[slot]) { st -> byWindow[st -> windows[slot]].slots.Add(slot); }
+  st -> groupings[slot] = grouping;
+  if(grouping != GUID_NULL) { st -> byGroup[grouping].Add(slot); }
+  st -> levels[slot] = 1.0f;
+  st -> count++;
+  return slot;
+}
+
+// StoreRemoveSession
+// Frees a slot and hands its COM pointers to retiredSessions. The caller must
+// hold hashmapCriticalSection.
+void StoreRemoveSession(DWORD slot)
+{
+  SessionStore * st = &sessionStore;
+  RetiredSession retired = {st -> sessions[slot], st -> volumes[slot], st -> sinks[slot]};
+  retiredSessions.push_back(retired);
+
+  if(st -> flags[slot] & SF_CROSS_PROCESS) { st -> crossProcess.Remove(slot); }
+  else
+  {
+    if(st -> flags[slot] & SF_ACTIVE)
+    {
+      auto active = st -> activeByProcess.find(st -> processes[slot]);
+      if(active != st -> activeByProcess.end() && !--active -> second) { st -> activeByProcess.erase(active); }
+    }
+    auto list = st -> byProcess.find(st -> processes[slot]);
+    if(list != st -> byProcess.end())
+    {
+      list -> second.Remove(slot);
+      if(!list -> second.count) { st -> byProcess.erase(list); }
+    }
+  }
+  if(st -> windows[slot])
+  {
+    // The window stays indexed; it may start another session
+    auto window = st -> byWindow.find(st -> windows[slot]);
+    if(window != st -> byWindow.end()) { window -> second.slots.Remove(slot); }
+    st -> windows[slot] = NULL;
+  }
+  if(st -> groupings[slot] != GUID_NULL)
+  {
+    auto group = st -> byGroup.find(st -> groupings[slot]);
+    if(group != st -> byGroup.end())
+    {
+      group -> second.Remove(slot);
+      if(!group -> second.count) { st -> byGroup.erase(group); }
+    }
+    st -> groupings[slot] = GUID_NULL;
+  }
+  sessionIdSet.erase(st -> metadata[slot].instanceId.View());
+  sessionArena.liveBytes -= MetadataBytes(st -> metadata[slot]);
+  if(st -> flags[slot] & SF_MUTED) { st -> mutedCount--; }
+  if(st -> flags[slot] & SF_OVERRIDE) { st -> overrideCount--; }
+
+  st -> sessions[slot] = NULL;
+  st -> volumes[slot] = NULL;
+  st -> sinks[slot] = NULL;
+  st -> flags[slot] = 0;
+  st -> metadata[slot] = SessionMetadata();
+  st -> generations[slot]++;
+  st -> freeSlots.push_back(slot);
+  st -> count--;
+  SnapshotSession(slot);
+}
+
+// CountVisibleWindow
+// Counts a window in or out of visibleByProcess, if it is on the current
+// desktop. The caller must hold hashmapCriticalSection.
+void CountVisibleWindow(const WindowEntry & entry, int delta)
+{
+  SessionStore * st = &sessionStore;
+  if(entry.desktop == GUID_NULL || entry.desktop != st -> currentDesktop) { return; }
+  if(delta > 0) { st -> visibleByProcess[entry.process]++; return; }
+  auto count = st -> visibleByProcess.find(entry.process);
+  if(count != st -> visibleByProcess.end() && !--count -> second) { st -> visibleByProcess.erase(count); }
+}
+
+// ForgetWindow
+// Drops a destroyed window from the window index. Its sessions follow their
+// process from now on. Returns how many sessions that applies to. The caller
+// must hold hashmapCriticalSection.
+DWORD ForgetWindow(HWND hwnd)
+{
+  SessionStore * st = &sessionStore;
+  auto window = st -> byWindow.find(hwnd);
+  if(window == st -> byWindow.end()) { return 0; }
+  DWORD detached = window -> second.slots.count;
+  for(DWORD i = 0; i < detached; i++) { st -> windows[window -> second.slots[i]] = NULL; }
+  auto last = st -> lastWindows.find(window -> second.process);
+  if(last != st -> lastWindows.end() && last -> second == hwnd) { st -> lastWindows.erase(last); }
+  CountVisibleWindow(window -> second, -1);
+  st -> byWindow.erase(window);
+  return detached;
+}
+
+// NoteFocusedWindow
+// Indexes hwnd as the window of process with focus, so sessions the process
+// creates from now on are attributed to it. The caller must hold
+// hashmapCriticalSection.
+void NoteFocusedWindow(ProcessIdentity process, HWND hwnd)
+{
+  if(!hwnd) { return; }
+  auto window = sessionStore.byWindow.find(hwnd);
+  // A handle indexed under another process was destroyed unnoticed and reused
+  if(window != sessionStore.byWindow.end() && window -> second.process != process) { ForgetWindow(hwnd); }
+  sessionStore.byWindow[hwnd].process = process;
+  sessionStore.lastWindows[process] = hwnd;
+}
+
+// NoteWindowDesktop
+// Records that hwnd of process, just focused, is on desktop, which is therefore
+// the desktop in view. Returns true if that is a different desktop than before,
+// in which case every indexed window has been counted again. Windows moved to
+// another desktop while out of focus keep their old desktop until focused. The
+// caller must hold hashmapCriticalSection.
+bool NoteWindowDesktop(ProcessIdentity process, HWND hwnd, const GUID & desktop)
+{
+  SessionStore * st = &sessionStore;
+  if(!hwnd || desktop == GUID_NULL) { return false; }
+  NoteFocusedWindow(process, hwnd);
+  WindowEntry & entry = st -> byWindow[hwnd];
+  if(desktop == st -> currentDesktop)
+  {
+    if(entry.desktop != desktop)
+    {
+      entry.desktop = desktop;
+      CountVisibleWindow(entry, 1);
+    }
+    return false;
+  }
+
+  entry.desktop = desktop;
+  st -> currentDesktop = desktop;
+  st -> visibleByProcess.clear();
+  for(auto w = st -> byWindow.begin(); w != st -> byWindow.end(); ++w) { CountVisibleWindow(w -> second, 1); }
+  return true;
+}
+
+// Whether the engine may change the mute state of the session in slot
+inline bool SessionManaged(DWORD slot)
+{
+  BYTE flags = sessionStore.flags[slot];
+  return !(flags & SF_OVERRIDE) && (!(flags & SF_CROSS_PROCESS) || crossProcessPolicy != CP_IGNORE);
+}
+
+// Whether the session in slot should be audible with focusedWindow of
+// focusedProc focused. A NULL focusedWindow stands for the whole process, and
+// so does a window with no sessions of its own, like a dialog or a settings
+// window: only a window with media of its own takes over from the others.
+// Cross-process sessions follow crossProcessPolicy instead; with CP_FOLLOW_APP
+// focusedProc must be the focus recorded in the session store.
+inline bool SessionAudible(DWORD slot, ProcessIdentity focusedProc, HWND focusedWindow)
+{
+  if(sessionStore.flags[slot] & SF_CROSS_PROCESS)
+  {
+    switch(crossProcessPolicy)
+    {
+    case CP_FOLLOW_SERVICE: return sessionStore.processes[slot] == focusedProc;
+    case CP_FOLLOW_APP: return sessionStore.focusedFollowedApp;
+    default: return false;
+    }
+  }
+  HWND window = sessionStore.windows[slot];
+  if(sessionStore.processes[slot] == focusedProc)
+  {
+    if(!window || !focusedWindow || window == focusedWindow) { return true; }
+    auto focused = sessionStore.byWindow.find(focusedWindow);
+    if(focused == sessionStore.byWindow.end() || !focused -> second.slots.count) { return true; }
+  }
+  if(!desktopMode) { return false; }
+
+  // A session of a window on the desktop in view, or with no window of its own
+  // but a process with a window there
+  if(!window) { return sessionStore.visibleByProcess.count(sessionStore.processes[slot]) != 0; }
+  auto entry = sessionStore.byWindow.find(window);
+  return entry != sessionStore.byWindow.end()
+    && entry -> second.desktop != GUID_NULL
+    && entry -> second.desktop == sessionStore.currentDesktop;
+}
+
+// SetSessionActive
+// Records whether the session in slot is producing audio, unless the slot has
+// been reused since the caller learned of it. Returns true if that made its
+// process go from silent to active.
+bool SetSessionActive(DWORD slot, DWORD generation, bool active)
+{
+  SessionStore * st = &sessionStore;
+  bool activated = false;
+  EnterCriticalSection(&hashmapCriticalSection);
+  if(slot < st -> flags.size()
+    && st -> generations[slot] == generation
+    && (st -> flags[slot] & SF_IN_USE)
+    && ((st -> flags[slot] & SF_ACTIVE) != 0) != active)
+  {
+    st -> flags[slot] ^= SF_ACTIVE;
+    if(!(st -> flags[slot] & SF_CROSS_PROCESS))
+    {
+      if(active) { activated = ++st -> activeByProcess[st -> processes[slot]] == 1; }
+      else
+      {
+        auto count = st -> activeByProcess.find(st -> processes[slot]);
+        if(count != st -> activeByProcess.end() && !--count -> second) { st -> activeByProcess.erase(count); }
+      }
+    }
+  }
+  LeaveCriticalSection(&hashmapCriticalSection);
+  return activated;
+}
+
+// RecordExternalChange
+// Records a mute or volume change that the engine didn't make to the session
+// in slot. If it undoes what the engine applied, it is the user's say, so the
+// session becomes an override, which the engine leaves alone until the session
+// ends, and no longer counts as muted by the engine: in mute mode when the mute
+// state is no longer the engine's, in duck mode when a ducked session's volume
+// is changed or any session is muted. Anything else, such as an app setting its
+// own volume under the engine's mute, only updates the level. The level is
+// kept, so ducking and restoring take no queries.
+void RecordExternalChange(DWORD slot, DWORD generation, float level, BOOL muted)
+{
+  SessionStore * st = &sessionStore;
+  EnterCriticalSection(&hashmapCriticalSection);
+  if(slot < st -> flags.size()
+    && st -> generations[slot] == generation
+    && (st -> flags[slot] & SF_IN_USE))
+  {
+    st -> levels[slot] = level;
+    bool engineMuted = (st -> flags[slot] & SF_MUTED) != 0;
+    bool taken = duckMode ? (muted || engineMuted) : (!muted != !engineMuted);
+    if(taken && !(st -> flags[slot] & SF_OVERRIDE))
+    {
+      st -> overrideCount++;
+      st -> flags[slot] |= SF_OVERRIDE;
+    }
+    if(taken && engineMuted)
+    {
+      // The user's state now, not ours to undo
+      st -> mutedCount--;
+      st -> flags[slot] &= ~SF_MUTED;
+      AppendJournal(slot, false);
+    }
+    SnapshotSession(slot);
+  }
+  LeaveCriticalSection(&hashmapCriticalSection);
+}
+
+// ReleaseOverrides
+// Hands every overridden session back to the engine. Returns how many there
+// were. The caller must hold hashmapCriticalSection.
+size_t ReleaseOverrides()
+{
+  size_t released = sessionStore.overrideCount;
+  for(DWORD slot = 0; slot < sessionStore.flags.size() && sessionStore.overrideCount; slot++)
+  {
+    if(!(sessionStore.flags[slot] & SF_OVERRIDE)) { continue; }
+    sessionStore.flags[slot] &= ~SF_OVERRIDE;
+    sessionStore.overrideCount--;
+    SnapshotSession(slot);
+  }
+  return released;
+}
+
+// Whether process has a session producing audio. The caller must hold
+// hashmapCriticalSection.
+inline bool ProcessActive(ProcessIdentity process)
+{
+  return sessionStore.activeByProcess.count(process) != 0;
+}
+
+// RetireSession
+// Removes the session in slot, unless the slot has been reused since the caller
+// learned of it. Safe to call from a session's own callbacks.
+void RetireSession(DWORD slot, DWORD generation)
+{
+  EnterCriticalSection(&hashmapCriticalSection);
+  if(slot < sessionStore.flags.size()
+    && sessionStore.generations[slot] == generation
+    && (sessionStore.flags[slot] & SF_IN_USE))
+  {
+    StoreRemoveSession(slot);
+  }
+  LeaveCriticalSection(&hashmapCriticalSection);
+}
+
+// CompactSessionArena
+// Once retired sessions own most of the session arena, copies the live metadata
+// into a new arena and releases the old one in bulk. The caller must hold
+// hashmapCriticalSection.
+void CompactSessionArena()
+{
+  size_t deadBytes = sessionArena.totalBytes > sessionArena.liveBytes
+    ? sessionArena.totalBytes - sessionArena.liveBytes : 0;
+  if(sessionArena.totalBytes < ARENA_BLOCK_SIZE || deadBytes < sessionArena.liveBytes)
+  {
+    return;
+  }
+
+  StringArena compacted = {};
+  sessionIdSet.clear();
+  for(DWORD slot = 0; slot < sessionStore.flags.size(); slot++)
+  {
+    if(!(sessionStore.flags[slot] & SF_IN_USE)) { continue; }
+    SessionMetadata * pMetadata = &sessionStore.metadata[slot];
+    pMetadata -> displayName = ArenaCopy(&compacted, pMetadata -> displayName);
+    pMetadata -> sessionId = ArenaCopy(&compacted, pMetadata -> sessionId);
+    pMetadata -> instanceId = ArenaCopy(&compacted, pMetadata -> instanceId);
+    sessionIdSet.insert(pMetadata -> instanceId.View());
+  }
+  compacted.liveBytes = sessionArena.liveBytes;
+  ArenaReset(&sessionArena);
+  sessionArena = compacted;
+}
+
+// ReleaseRetiredSessions
+// Unregisters and releases the sessions removed since the last call, and lets
+// the session arena drop their metadata. Must not be called from a session
+// callback.
+void ReleaseRetiredSessions()
+{
+  vector<RetiredSession> retired;
+  EnterCriticalSection(&hashmapCriticalSection);
+  retired.swap(retiredSessions);
+  // Compaction copies every live string, so it waits for game mode to end
+  if(!retired.empty() && !gameMode) { CompactSessionArena(); }
+  LeaveCriticalSection(&hashmapCriticalSection);
+
+  for(auto p = retired.begin(); p != retired.end(); ++p)
+  {
+    if(p -> pEvents)
+    {
+      p -> pSession -> UnregisterAudioSessionNotification(p -> pEvents);
+      p -> pEvents -> Release();
+    }
+    if(p -> pVolume) { p -> pVolume -> Release(); }
+    p -> pSession -> Release();
+  }
+}
+
+// GetIAudioSessionManager2
+// Retrieves and passes out a pointer to the IAudioSessionManager2 interface for the
+// default audio endpoint device at the address pointed to by ppSessionManager..
+// Returns S_OK if successful, E_POINTER if ppSessionManager is null, E_UNEXPECTED if
+// the address pointed to by ppSessionManager is not empty, or the HRESULT value from
+// any Windows API call which returnes a value other than S_OK (this function aborts
+// at the first such occurrence).
+// The caller must initialize COM in its thread before calling this function, and if
+// this function returns S_OK then the caller must release the IAudioSessionManager2
+// interface when no longer needed by calling its Release() method.  If this function
+// does not return S_OK, then the caller does not need to clean up anything.
+HRESULT GetIAudioSessionManager2(IAudioSessionManager2 ** ppSessionManager)
+{
+  HRESULT hr;
+  IMMDevice * pDev = NULL;
+  IMMDeviceEnumerator * pDevEnum = NULL;
+
+  if(!ppSessionManager)
+  {
+    #if LOGGING
+    printf("ERROR: In-out pointer ppSessionManager == NULL.\n");
+    #endif
+    return E_POINTER;
+  }
+  else if(*ppSessionManager)
+  {
+    #if LOGGING
+    printf("ERROR: Passed ppSessionManager points to a non-null pointer.\n");
+    #endif
+    return E_UNEXPECTED;
+  }
+
+  // Initiaze the MMDevideEnumerator to get the audio endpoint device
+  hr = CoCreateInstance(
+      __uuidof(MMDeviceEnumerator),
+      NULL,
+      CLSCTX_ALL,
+      __uuidof(IMMDeviceEnumerator),
+      (void **) &pDevEnum
+  );
+  if(hr != S_OK) // If something went wrong
+  {
+    #if LOGGING
+    printf("ERROR: CoCreateInstance failed with code %ld.\n", hr);
+    #endif
+    return hr;
+  }
+  // Get the audio endpoint device
+  hr = pDevEnum -> GetDefaultAudioEndpoint(eRender, eConsole, &pDev);
+  // We're done with the device enumerator, one way or the other
+  pDevEnum -> Release();
+  if(hr != S_OK) // If something went wrong
+  {
+    #if LOGGING
+    printf("ERROR: GetDefaultAudioEndpoint failed with code %ld.\n", hr);
+    #endif
+    return hr;
+  }
+
+  hr = pDev -> Activate(
+    __uuidof(IAudioSessionManager2),
+    CLSCTX_ALL,
+    NULL,
+    (void **) ppSessionManager
+  );
+  pDev -> Release();
+  #if LOGGING
+  if(hr != S_OK)
+  {
+    printf("ERROR: Activate IAudioSessionManager2 failed with code %ld.", hr);
+  }
+  else
+  {
+    printf("IAudioSessionManager2 initialized.");
+  }
+  #endif
+  return hr;
+}
+
+// RegroupSession
+// Moves the session in slot to another group, unless the slot has been reused
+// since the caller learned of it. Called on a WASAPI thread, so the groups are
+// only decided again once the audio thread refreshes, which it does through the
+// state machine: not while paused, and not before anything has been focused.
+// The refresh is requested under the lock, so an invariant check made after the
+// move knows the mute states are not yet expected to match.
+void RegroupSession(DWORD slot, DWORD generation, const GUID & grouping)
+{
+  SessionStore * st = &sessionStore;
+  bool moved = false;
+  EnterCriticalSection(&hashmapCriticalSection);
+  if(slot < st -> flags.size()
+    && st -> generations[slot] == generation
+    && (st -> flags[slot] & SF_IN_USE)
+    && st -> groupings[slot] != grouping)
+  {
+    auto oldGroup = st -> byGroup.find(st -> groupings[slot]);
+    if(oldGroup != st -> byGroup.end())
+    {
+      oldGroup -> second.Remove(slot);
+      if(!oldGroup -> second.count) { st -> byGroup.erase(oldGroup); }
+    }
+    st -> groupings[slot] = grouping;
+    if(grouping != GUID_NULL) { st -> byGroup[grouping].Add(slot); }
+    engineStats.regroupings++;
+    InterlockedExchange(&refreshRequested, 1);
+    moved = true;
+  }
+  LeaveCriticalSection(&hashmapCriticalSection);
+  if(moved) { SetEvent(ghEvents[0]); }
+}
+
+// Callback for audio session event notification
+// Mostly copied from Microsoft Learn IAudioSessionEvents example
+// One instance is registered per session, and knows the session's slot and
+// generation in the session store so that it can retire the session
+//-----------------------------------------------------------
+// Client implementation of IAudioSessionEvents interface.
+// WASAPI calls these methods to notify the application when
+// a parameter or property of the audio session changes.
+//-----------------------------------------------------------
+class CAudioSessionEvents : public IAudioSessionEvents
+{
+    LONG _cRef;
+    DWORD _slot;
+    DWORD _generation;
+
+public:
+    CAudioSessionEvents(DWORD slot, DWORD generation) :
+        _cRef(1),
+        _slot(slot),
+        _generation(generation)
+    {
+    }
+
+    ~CAudioSessionEvents()
+    {
+    }
+
+    // IUnknown methods -- AddRef, Release, and QueryInterface
+
+    ULONG STDMETHODCALLTYPE AddRef()
+    {
+        return InterlockedIncrement(&_cRef);
+    }
+
+    ULONG STDMETHODCALLTYPE Release()
+    {
+        ULONG ulRef = InterlockedDecrement(&_cRef);
+        if (0 == ulRef)
+        {
+            delete this;
+        }
+        return ulRef;
+    }
+
+    HRESULT STDMETHODCALLTYPE QueryInterface(
+                                REFIID  riid,
+                                VOID  **ppvInterface)
+    {
+        if (IID_IUnknown == riid)
+        {
+            AddRef();
+            *ppvInterface = (IUnknown*)this;
+        }
+        else if (__uuidof(IAudioSessionEvents) == riid)
+        {
+            AddRef();
+            *ppvInterface = (IAudioSessionEvents*)this;
+        }
+        else
+        {
+            *ppvInterface = NULL;
+            return E_NOINTERFACE;
+        }
+        return S_OK;
+    }
+
+    // Notification methods for audio session events
+
+    HRESULT STDMETHODCALLTYPE OnDisplayNameChanged(
+                                LPCWSTR NewDisplayName,
+                                LPCGUID EventContext)
+    {
+        return S_OK;
+    }
+
+    HRESULT STDMETHODCALLTYPE OnIconPathChanged(
+                                LPCWSTR NewIconPath,
+                                LPCGUID EventContext)
+    {
+        return S_OK;
+    }
+
+    HRESULT STDMETHODCALLTYPE OnSimpleVolumeChanged(
+                                float NewVolume,
+                                BOOL NewMute,
+                                LPCGUID EventContext)
+    {
+        // The engine's own changes come back here too; drop them first thing
+        if (EventContext && *EventContext == engineEventContext)
+        {
+            InterlockedIncrement64(&engineStats.echoedChanges);
+            return S_OK;
+        }
+        InterlockedIncrement64(&engineStats.externalChanges);
+        RecordExternalChange(_slot, _generation, NewVolume, NewMute);
+        if (NewMute)
+        {
+            EventLog("MUTE\n");
+        }
+        else
+        {
+            EventLog("Volume = %d percent\n",
+                   (UINT32)(100*NewVolume + 0.5));
+        }
+
+        return S_OK;
+    }
+
+    HRESULT STDMETHODCALLTYPE OnChannelVolumeChanged(
+                                DWORD ChannelCount,
+                                float NewChannelVolumeArray[],
+                                DWORD ChangedChannel,
+                                LPCGUID EventContext)
+    {
+        return S_OK;
+    }
+
+    HRESULT STDMETHODCALLTYPE OnGroupingParamChanged(
+                                LPCGUID NewGroupingParam,
+                                LPCGUID EventContext)
+    {
+        if (NewGroupingParam)
+        {
+            RegroupSession(_slot, _generation, *NewGroupingParam);
+        }
+        return S_OK;
+    }
+
+    HRESULT STDMETHODCALLTYPE OnStateChanged(
+                                AudioSessionState NewState)
+    {
+        char *pszState = "?????";
+
+        switch (NewState)
+        {
+        case AudioSessionStateActive:
+            pszState = "active";
+            // A held switch may be waiting for this process to play
+            if (SetSessionActive(_slot, _generation, true) && keepAudibleMode)
+            {
+                InterlockedExchange(&activationRequested, 1);
+                SetEvent(ghEvents[0]);
+            }
+            break;
+        case AudioSessionStateInactive:
+            pszState = "inactive";
+            SetSessionActive(_slot, _generation, false);
+            break;
+        case AudioSessionStateExpired:
+            pszState = "expired";
+            RetireSession(_slot, _generation);
+            break;
+        }
+        EventLog("New session state = %s\n", pszState);
+
+        return S_OK;
+    }
+
+    HRESULT STDMETHODCALLTYPE OnSessionDisconnected(
+              AudioSessionDisconnectReason DisconnectReason)
+    {
+        char *pszReason = "?????";
+
+        switch (DisconnectReason)
+        {
+        case DisconnectReasonDeviceRemoval:
+            pszReason = "device removed";
+            break;
+        case DisconnectReasonServerShutdown:
+            pszReason = "server shut down";
+            break;
+        case DisconnectReasonFormatChanged:
+            pszReason = "format changed";
+            break;
+        case DisconnectReasonSessionLogoff:
+            pszReason = "user logged off";
+            break;
+        case DisconnectReasonSessionDisconnected:
+            pszReason = "session disconnected";
+            break;
+        case DisconnectReasonExclusiveModeOverride:
+            pszReason = "exclusive-mode override";
+            break;
+        }
+        EventLog("Audio session disconnected (reason: %s)\n",
+                 pszReason);
+
+        RetireSession(_slot, _generation);
+        return S_OK;
+    }
+};
+
+// Add an audio session to the programs internal tracker
+// Prints information about the session, adds it to the session store and
+// registers a CAudioSessionEvents instance for it
+// This method will increase the ref count to pSession if it succeeds
+// Caller should release pSession when caller is done with it
+HRESULT AddAudioSession(IAudioSessionControl2 * pSession)
+{
+  if(!pSession)
+  {
+    #if LOGGING
+    printf("ERROR: AddAudioSession received a null pointer.\n");
+    #endif
+    return E_POINTER;
+  }
+  HRESULT hr = S_OK;
+  DWORD sessionProcessId = 0;
+  LPWSTR pswDisplayName = NULL;
+  LPWSTR pswSessionId = NULL;
+  LPWSTR pswSessionInstance = NULL;
+  // In game mode only the instance identifier is fetched, which is needed to
+  // tell duplicates apart; the session goes without a name
+  bool fetchMetadata = !gameMode;
+  hr = fetchMetadata ? pSession -> GetDisplayName(&pswDisplayName) : S_OK;
+  if(hr != S_OK)
+  {
+    #if LOGGING
+    printf("ERROR: GetDisplayName failed with error code: %ld\n", hr);
+    #endif
+    return hr;
+  }
+  hr = fetchMetadata ? pSession -> GetSessionIdentifier(&pswSessionId) : S_OK;
+  if(hr != S_OK)
+  {
+    #if LOGGING
+    printf("ERROR: GetSessionIndentifier failed with error code: %ld\n", hr);
+    #endif
+    CoTaskMemFree(pswDisplayName);
+    return hr;
+  }
+  hr = pSession -> GetSessionInstanceIdentifier(&pswSessionInstance);
+  if(hr != S_OK)
+  {
+    #if LOGGING
+    printf("ERROR: GetSessionInstanceIdentifier failed with error code: %ld\n", hr);
+    #endif
+    CoTaskMemFree(pswDisplayName);
+    CoTaskMemFree(pswSessionId);
+    return hr;
+  }
+
+  hr = pSession -> GetProcessId(&sessionProcessId);
+  if(hr != S_OK && hr != AUDCLNT_S_NO_SINGLE_PROCESS)
+  {
+    #if LOGGING
+    printf("ERROR: GetProcessId failed with error code: %ld\n", hr);
+    #endif
+    return hr;
+  }
+  EventLog("Audio Session found. Process: %ld, Name: %ls, Identifier: %ls, Instance: %ls\n", sessionProcessId, pswDisplayName, pswSessionId, pswSessionInstance);
+
+  bool crossProcess = hr == AUDCLNT_S_NO_SINGLE_PROCESS;
+  if(crossProcess)
+  {
+    // Kept out of the process index and handled by crossProcessPolicy
+    EventLog("This session is a cross-process audio session.\n");
+  }
+
+  // Cache the volume interface, so switching doesn't have to query for it
+  ISimpleAudioVolume * pVolume = NULL;
+  hr = pSession -> QueryInterface<ISimpleAudioVolume>(&pVolume);
+  if(hr != S_OK)
+  {
+    #if LOGGING
+    printf("ERROR: QueryInterface for ISimpleAudioVolume failed with error code: %ld\n", hr);
+    #endif
+    CoTaskMemFree(pswDisplayName);
+    CoTaskMemFree(pswSessionId);
+    CoTaskMemFree(pswSessionInstance);
+    return hr;
+  }
+
+  // Resolve the identity outside the lock, since it may have to open the process
+  ProcessIdentity process = ResolveProcessIdentity(sessionProcessId);
+  // A session whose grouping can't be read is muted on its own
+  GUID grouping = GUID_NULL;
+  if(pSession -> GetGroupingParam(&grouping) != S_OK) { grouping = GUID_NULL; }
+  BYTE sessionFlags = crossProcess ? SF_CROSS_PROCESS : 0;
+  AudioSessionState state;
+  if(pSession -> GetState(&state) == S_OK && state == AudioSessionStateActive) { sessionFlags |= SF_ACTIVE; }
+  // The only volume query made for the session; callbacks keep it current
+  float level = 1.0f;
+  if(pVolume -> GetMasterVolume(&level) != S_OK) { level = 1.0f; }
+
+  // Copy the metadata into the arena once. The instance identifier is unique to
+  // each session, so it identifies duplicates reported both by the enumerator
+  // and the creation callback; their copies are rolled back at once.
+  EnterCriticalSection(&hashmapCriticalSection);
+  ArenaMark mark = GetArenaMark(&sessionArena);
+  SessionMetadata metadata;
+  metadata.instanceId = ArenaCopyWide(&sessionArena, pswSessionInstance);
+  bool duplicate = !sessionIdSet.insert(metadata.instanceId.View()).second;
+  if(duplicate)
+  {
+    ArenaRollback(&sessionArena, mark);
+    LeaveCriticalSection(&hashmapCriticalSection);
+    CoTaskMemFree(pswDisplayName);
+    CoTaskMemFree(pswSessionId);
+    CoTaskMemFree(pswSessionInstance);
+    pVolume -> Release();
+    EventLog("This session is a duplicate.\n");
+    return S_OK;
+  }
+  metadata.displayName = ArenaCopyWide(&sessionArena, pswDisplayName);
+  metadata.sessionId = ArenaCopyWide(&sessionArena, pswSessionId);
+  CoTaskMemFree(pswDisplayName);
+  CoTaskMemFree(pswSessionId);
+  CoTaskMemFree(pswSessionInstance);
+  DWORD slot = StoreAddSession(process, sessionFlags, pSession, pVolume, grouping, metadata);
+  sessionStore.levels[slot] = level;
+  RestoreSessionState(slot);
+  SnapshotSession(slot);
+  DWORD generation = sessionStore.generations[slot];
+  CAudioSessionEvents * pEvents = new CAudioSessionEvents(slot, generation);
+  sessionStore.sinks[slot] = pEvents;
+  LeaveCriticalSection(&hashmapCriticalSection);
+
+  hr = pSession -> RegisterAudioSessionNotification(pEvents);
+  if(hr != S_OK)
+  {
+    #if LOGGING
+    printf("ERROR: RegisterAudioSessionNotification failed with error code %ld\n", hr);
+    #endif
+    // The audio thread releases the session along with its unused sink
+    RetireSession(slot, generation);
+    return hr;
+  }
+
+  return hr;
+}
+
+// Callback for new audio session creation
+// Mostly copied from Microsoft Learn IAudioSessionNotification example
+// The contents of OnSessionCreated have been modified, and errors in the definition fixed
+class CSessionNotifier: public IAudioSessionNotification
+{
+private:
+
+    LONG m_cRefAll;
+    HWND m_hwndMain;
+
+//    ~CSessionNotifier(){};
+
+public:
+
+    CSessionNotifier(HWND hWnd):
+      m_cRefAll(1),
+      m_hwndMain (hWnd)
+    {}
+
+    // IUnknown
+    HRESULT STDMETHODCALLTYPE QueryInterface(REFIID riid, void **ppvInterface)  
+    {    
+      if (IID_IUnknown == riid)
+      {
+        AddRef();
+        *ppvInterface = (IUnknown*)this;
+      }
+      else if (__uuidof(IAudioSessionNotification) == riid)
+      {
+        AddRef();
+        *ppvInterface = (IAudioSessionNotification*)this;
+      }
+      else
+      {
+        *ppvInterface = NULL;
+        return E_NOINTERFACE;
+      }
+      return S_OK;
+    }
+    
+    ULONG STDMETHODCALLTYPE AddRef()
+    {
+      return InterlockedIncrement(&m_cRefAll);
+    }
+     
+    ULONG STDMETHODCALLTYPE Release()
+    {
+      ULONG ulRef = InterlockedDecrement(&m_cRefAll);
+      if (0 == ulRef)
+      {
+        delete this;
+      }
+      return ulRef;
+    }
+
+    HRESULT OnSessionCreated(IAudioSessionControl *pNewSession)
+    {
+      if (!pNewSession)
+      {
+        return E_POINTER;
+      }
+      // PostMessage(m_hwndMain, WM_SESSION_CREATED, 0, 0);
+      IAudioSessionControl2 * pCtrl2 = NULL;
+      HRESULT hr = S_OK;
+      hr = pNewSession -> QueryInterface<IAudioSessionControl2>(&pCtrl2);
+      if(hr != S_OK)
+      {
+        #if LOGGING
+        printf("ERROR: QueryInterface for IAudioSessionControl2 failed with error code: %ld\n", hr);
+        #endif
+        return hr;
+      }
+      hr = AddAudioSession(pCtrl2);
+      pCtrl2 -> Release();
+      return hr;
+    }
+};
+
+inline void CountBackendCall(HRESULT hr)
+{
+  engineStats.backendCalls++;
+  if(FAILED(hr))
+  {
+    engineStats.backendFailures++;
+    engineStats.lastError = hr;
+  }
+}
+
+// SetSessionMute
+// Sets the mute state of the session in slot and keeps its flags in step. In
+// duck mode, lowers the session to duckFraction of its recorded volume instead,
+// or restores that volume, with one backend call just the same. The caller must
+// hold hashmapCriticalSection.
+HRESULT SetSessionMute(DWORD slot, BOOL mute)
+{
+  // A mute is journalled before it is applied, so a kill between the two leaves
+  // it to be undone, and given back if it fails; an unmute is journalled once it
+  // is done, so a kill between leaves an undo that changes nothing
+  if(mute) { AppendJournal(slot, true); }
+  HRESULT hr;
+  if(duckMode)
+  {
+    float level = sessionStore.levels[slot];
+    hr = sessionStore.volumes[slot] -> SetMasterVolume(mute ? level * duckFraction : level, &engineEventContext);
+  }
+  else { hr = sessionStore.volumes[slot] -> SetMute(mute, &engineEventContext); }
+  CountBackendCall(hr);
+  BYTE * pFlags = &sessionStore.flags[slot];
+  if(SUCCEEDED(hr))
+  {
+    if(mute && !(*pFlags & SF_MUTED)) { sessionStore.mutedCount++; }
+    if(!mute && (*pFlags & SF_MUTED)) { sessionStore.mutedCount--; }
+    *pFlags = mute ? (*pFlags | SF_MUTED) : (*pFlags & ~SF_MUTED);
+    SnapshotSession(slot);
+    if(!mute) { AppendJournal(slot, false); }
+  }
+  else if(mute && !(*pFlags & SF_MUTED)) { AppendJournal(slot, false); }
+  return hr;
+}
+
+// GetSessionMute
+// Reads back whether the session in slot is muted, or in duck mode whether it
+// is nearer its ducked volume than its recorded one.
+HRESULT GetSessionMute(DWORD slot, BOOL * pMuted)
+{
+  if(!duckMode) { return sessionStore.volumes[slot] -> GetMute(pMuted); }
+  float volume;
+  HRESULT hr = sessionStore.volumes[slot] -> GetMasterVolume(&volume);
+  if(hr == S_OK)
+  {
+    float level = sessionStore.levels[slot];
+    *pMuted = volume < level * (1.0f + duckFraction) / 2;
+  }
+  return hr;
+}
+
+// Whether the sessions of a group should be audible: the group is one unit,
+// audible if any of its sessions would be on its own
+bool GroupAudible(const SlotList & group, ProcessIdentity focusedProc, HWND focusedWindow)
+{
+  for(DWORD i = 0; i < group.count; i++)
+  {
+    if(SessionAudible(group[i], focusedProc, focusedWindow)) { return true; }
+  }
+  return false;
+}
+
+// Groups already decided in the current apply pass
+unordered_set<GUID, GuidHash> decidedGroups;
+
+// ApplySessionDecision
+// Mutes or unmutes the session in slot for the focus recorded in the session
+// store. A grouped session has the decision made once for its whole group,
+// applied to every session of the group in a batch, and skipped for the rest
+// of the pass. With changesOnly set, sessions already in the decided state are
+// left alone. The caller must hold hashmapCriticalSection and clear
+// decidedGroups at the start of each pass.
+void ApplySessionDecision(DWORD slot, bool changesOnly)
+{
+  SessionStore * st = &sessionStore;
+  const GUID & grouping = st -> groupings[slot];
+  BOOL mute;
+  if(grouping == GUID_NULL)
+  {
+    mute = !SessionAudible(slot, st -> focusedProcess, st -> focusedWindow);
+    if(SessionManaged(slot) && !(changesOnly && ((st -> flags[slot] & SF_MUTED) != 0) == mute))
+    {
+      SetSessionMute(slot, mute);
+    }
+    return;
+  }
+  if(!decidedGroups.insert(grouping).second) { return; }
+  const SlotList & group = st -> byGroup[grouping];
+  mute = !GroupAudible(group, st -> focusedProcess, st -> focusedWindow);
+  for(DWORD i = 0; i < group.count; i++)
+  {
+    DWORD member = group[i];
+    if(SessionManaged(member) && !(changesOnly && ((st -> flags[member] & SF_MUTED) != 0) == mute))
+    {
+      SetSessionMute(member, mute);
+    }
+  }
+}
+
+// Records the focus the mute states are about to be applied for
+void SetStoreFocus(ProcessIdentity focusedProc, HWND focusedWindow)
+{
+  NoteFocusedWindow(focusedProc, focusedWindow);
+  sessionStore.focusedProcess = focusedProc;
+  sessionStore.focusedWindow = focusedWindow;
+  sessionStore.focusedFollowedApp = crossProcessPolicy == CP_FOLLOW_APP && IsFollowedApp(focusedProc);
+}
+
+// Moves focus from oldProc to newWindow of newProc. Within newProc only the
+// sessions attributed to other windows are muted, so switching between two
+// windows of one process mutes and unmutes just their own sessions. Groups
+// with a session of either process are decided along with them, and so are
+// cross-process sessions whose decision changes. With requireActive set,
+// nothing changes unless newProc has an active session; returns whether the
+// switch was made.
+bool SwitchMuteStates(ProcessIdentity oldProc, ProcessIdentity newProc, HWND newWindow, bool requireActive)
+{
+  EnterCriticalSection(&hashmapCriticalSection);
+  if(requireActive && !ProcessActive(newProc))
+  {
+    LeaveCriticalSection(&hashmapCriticalSection);
+    return false;
+  }
+  SetStoreFocus(newProc, newWindow);
+  decidedGroups.clear();
+  ProcessIdentity procs[2] = {oldProc, newProc};
+  for(int p = oldProc == newProc ? 1 : 0; p < 2; p++)
+  {
+    auto list = sessionStore.byProcess.find(procs[p]);
+    if(list == sessionStore.byProcess.end()) { continue; }
+    for(DWORD i = 0; i < list -> second.count; i++) { ApplySessionDecision(list -> second[i], false); }
+  }
+  if(crossProcessPolicy != CP_IGNORE)
+  {
+    // There are few of these, so checking each costs less than indexing them
+    // by what they follow
+    const SlotList & cross = sessionStore.crossProcess;
+    for(DWORD i = 0; i < cross.count; i++)
+    {
+      DWORD slot = cross[i];
+      bool muted = (sessionStore.flags[slot] & SF_MUTED) != 0;
+      if(muted == SessionAudible(slot, newProc, newWindow)) { ApplySessionDecision(slot, false); }
+    }
+  }
+  LeaveCriticalSection(&hashmapCriticalSection);
+  return true;
+}
+
+// Sets the mute state of every tracked session, muting everything except the
+// sessions of focusedWindow of focusedProc and their groups. Used when the
+// tracked mute states can't be trusted.
+void RefreshMuteStates(ProcessIdentity focusedProc, HWND focusedWindow)
+{
+  EnterCriticalSection(&hashmapCriticalSection);
+  SetStoreFocus(focusedProc, focusedWindow);
+  decidedGroups.clear();
+  for(DWORD slot = 0; slot < sessionStore.flags.size(); slot++)
+  {
+    if(!(sessionStore.flags[slot] & SF_IN_USE)) { continue; }
+    ApplySessionDecision(slot, false);
+  }
+  LeaveCriticalSection(&hashmapCriticalSection);
+}
+
+// Applies a virtual desktop switch, focusing focusedWindow of focusedProc, in
+// one pass that changes only the sessions whose decision changed
+void ReconcileMuteStates(ProcessIdentity focusedProc, HWND focusedWindow)
+{
+  EnterCriticalSection(&hashmapCriticalSection);
+  SetStoreFocus(focusedProc, focusedWindow);
+  decidedGroups.clear();
+  for(DWORD slot = 0; slot < sessionStore.flags.size(); slot++)
+  {
+    if(!(sessionStore.flags[slot] & SF_IN_USE)) { continue; }
+    ApplySessionDecision(slot, true);
+  }
+  LeaveCriticalSection(&hashmapCriticalSection);
+}
+
+// UndoJournal
+// Undoes the mutes a previous instance left in force, as its journal records
+// them, for the sessions found at startup: unmutes each session whose last
+// record has it muted by the engine, or restores its volume if it was ducked.
+// Sessions that took the decision over from the snapshot are left muted for
+// the engine to reconcile, and sessions of another process by now are left
+// alone. The journal then starts again from the sessions still muted. Returns
+// the number of changes undone.
+size_t UndoJournal()
+{
+  if(!pJournal) { return 0; }
+  size_t undone = 0;
+  EnterCriticalSection(&hashmapCriticalSection);
+  SessionStore * st = &sessionStore;
+  // The last record of each session is its state when the instance died
+  unordered_map<ULONGLONG, JournalRecord> lastRecords;
+  LONG head = ReadAcquire(&pJournal -> head);
+  for(LONG i = 0; i < JournalCount(head); i++)
+  {
+    const JournalRecord & record = pJournal -> records[JournalHalf(head)][i];
+    if(record.check == JournalCheck(record)) { lastRecords[record.instanceHash] = record; }
+  }
+  for(DWORD slot = 0; slot < st -> flags.size() && !lastRecords.empty(); slot++)
+  {
+    if(!(st -> flags[slot] & SF_IN_USE)) { continue; }
+    auto entry = lastRecords.find(InstanceHash(st -> metadata[slot].instanceId.View()));
+    if(entry == lastRecords.end()) { continue; }
+    const JournalRecord record = entry -> second;
+    lastRecords.erase(entry);
+    if(!record.muted || (st -> flags[slot] & SF_MUTED)) { continue; }
+    if(record.processId != st -> processes[slot].processId || record.startTime != st -> processes[slot].startTime) { continue; }
+    HRESULT hr;
+    if(record.ducked)
+    {
+      hr = st -> volumes[slot] -> SetMasterVolume(record.level, &engineEventContext);
+      if(SUCCEEDED(hr)) { st -> levels[slot] = record.level; }
+    }
+    else { hr = st -> volumes[slot] -> SetMute(FALSE, &engineEventContext); }
+    CountBackendCall(hr);
+    if(SUCCEEDED(hr)) { undone++; }
+  }
+  engineStats.journalUndone += undone;
+  CompactJournal();
+  LeaveCriticalSection(&hashmapCriticalSection);
+  return undone;
+}
+
+// QueryWindowDesktop
+// Gets the virtual desktop hwnd is on. In stress mode the stand-in windows are
+// spread over stand-in desktops instead. Returns false if it can't tell, e.g.
+// for windows shown on every desktop.
+bool QueryWindowDesktop(HWND hwnd, GUID * pDesktop)
+{
+  if(stressSeconds)
+  {
+    *pDesktop = GUID_NULL;
+    pDesktop -> Data1 = (unsigned long) ((ULONG_PTR) hwnd % STRESS_DESKTOPS + 1);
+    return true;
+  }
+  return pDesktopManager
+    && pDesktopManager -> GetWindowDesktopId(hwnd, pDesktop) == S_OK
+    && *pDesktop != GUID_NULL;
+}
+
+// CheckSessionInvariants
+// Verifies the session list at a quiescent point, right after mute changes were
+// applied: no session is tracked twice, every session of focusedWindow of
+// focusedProc is unmuted, its other windows' sessions are muted, and every
+// session of mutedProc is muted, or of every other process if allOthersMuted
+// is set. A grouped session must instead match its group's decision, wherever
+// that group has a session of focusedProc or mutedProc. Logs each violation
+// and returns how many were found.
+LONG64 CheckSessionInvariants(ProcessIdentity focusedProc, HWND focusedWindow, ProcessIdentity mutedProc, bool allOthersMuted)
+{
+  LONG64 violations = 0;
+  unordered_set<IAudioSessionControl2 *> seen;
+  size_t indexed = 0;
+  EnterCriticalSection(&hashmapCriticalSection);
+  // A pending refresh, e.g. after a regrouping, will set the mute states again
+  bool mutesSettled = !ReadAcquire(&refreshRequested);
+  if(sessionStore.count != sessionIdSet.size())
+  {
+    printf("INVARIANT: %zu sessions tracked but %zu distinct instances.\n", sessionStore.count, sessionIdSet.size());
+    violations++;
+  }
+  for(auto p = sessionStore.byProcess.begin(); p != sessionStore.byProcess.end(); ++p)
+  {
+    indexed += p -> second.count;
+  }
+  indexed += sessionStore.crossProcess.count;
+  if(indexed != sessionStore.count)
+  {
+    printf("INVARIANT: %zu sessions tracked but %zu indexed by process.\n", sessionStore.count, indexed);
+    violations++;
+  }
+  size_t attributed = 0;
+  for(auto w = sessionStore.byWindow.begin(); w != sessionStore.byWindow.end(); ++w)
+  {
+    for(DWORD i = 0; i < w -> second.slots.count; i++)
+    {
+      DWORD slot = w -> second.slots[i];
+      if(sessionStore.windows[slot] != w -> first || sessionStore.processes[slot] != w -> second.process)
+      {
+        printf("INVARIANT: Session in slot %lu is indexed under the wrong window.\n", slot);
+        violations++;
+      }
+      attributed++;
+    }
+  }
+  for(DWORD slot = 0; slot < sessionStore.flags.size(); slot++)
+  {
+    if(!(sessionStore.flags[slot] & SF_IN_USE)) { continue; }
+    ProcessIdentity proc = sessionStore.processes[slot];
+    if(!seen.insert(sessionStore.sessions[slot]).second)
+    {
+      printf("INVARIANT: Session of process %ld is tracked twice.\n", proc.processId);
+      violations++;
+    }
+    if(sessionStore.windows[slot]) { attributed--; }
+    if(!mutesSettled || !SessionManaged(slot)) { continue; }
+
+    bool mustBeUnmuted, decided;
+    if(sessionStore.groupings[slot] == GUID_NULL)
+    {
+      mustBeUnmuted = SessionAudible(slot, focusedProc, focusedWindow);
+      decided = allOthersMuted || proc == mutedProc || proc == focusedProc;
+    }
+    else
+    {
+      auto group = sessionStore.byGroup.find(sessionStore.groupings[slot]);
+      if(group == sessionStore.byGroup.end())
+      {
+        printf("INVARIANT: Session in slot %lu is missing from its group.\n", slot);
+        violations++;
+        continue;
+      }
+      mustBeUnmuted = GroupAudible(group -> second, focusedProc, focusedWindow);
+      decided = allOthersMuted;
+      for(DWORD i = 0; i < group -> second.count && !decided; i++)
+      {
+        ProcessIdentity member = sessionStore.processes[group -> second[i]];
+        decided = member == mutedProc || member == focusedProc;
+      }
+    }
+    bool mustBeMuted = !mustBeUnmuted && decided;
+    if(!mustBeMuted && !mustBeUnmuted) { continue; }
+    // A silent session looks the same ducked or not
+    if(duckMode && sessionStore.levels[slot] <= 0.0f) { continue; }
+
+    BOOL muted = false;
+    if(GetSessionMute(slot, &muted) == S_OK && (muted ? mustBeUnmuted : mustBeMuted))
+    {
+      ArenaString name = sessionStore.metadata[slot].displayName;
+      printf("INVARIANT: Session \"%.*s\" of process %ld is %s, focused process is %ld.\n",
+        (int) name.length, name.data, proc.processId, muted ? "muted" : "unmuted", focusedProc.processId);
+      violations++;
+    }
+  }
+  if(attributed)
+  {
+    printf("INVARIANT: Window index and session attributions disagree.\n");
+    violations++;
+  }
+  LeaveCriticalSection(&hashmapCriticalSection);
+
+  engineStats.invariantChecks++;
+  InterlockedAdd64(&engineStats.invariantViolations, violations);
+  return violations;
+}
+
+// CheckFocusSnapshot
+// Checks, in stress mode, a focus snapshot read after one with previousSequence:
+// sequence numbers never go backwards, and the window and process were written
+// together, the stand-in windows of each process being numbered after its ID.
+// Called from the audio thread and the stress publishers alike.
+LONG64 CheckFocusSnapshot(const FocusSnapshot & snapshot, LONG64 previousSequence)
+{
+  LONG64 violations = 0;
+  if(snapshot.sequence < previousSequence)
+  {
+    printf("INVARIANT: Focus sequence went back from %lld to %lld.\n", previousSequence, snapshot.sequence);
+    violations++;
+  }
+  ULONGLONG window = (ULONGLONG) (ULONG_PTR) snapshot.hwnd;
+  if(snapshot.sequence && (!window || (window - 1) / STRESS_WINDOWS_PER_PROCESS != snapshot.process.processId))
+  {
+    printf("INVARIANT: Focus snapshot %lld has window %llu with process %ld.\n",
+      snapshot.sequence, window, snapshot.process.processId);
+    violations++;
+  }
+  InterlockedAdd64(&engineStats.invariantViolations, violations);
+  return violations;
+}
+
+// Control pipe
+// In daemon mode the audio thread serves a single-instance, message-mode named
+// pipe with overlapped I/O from its wait loop, one command per message. Nothing
+// here ever waits on a client, so a slow or stuck client can't hold up switching.
+enum ControlPipeStage { CP_CONNECTING, CP_READING, CP_WRITING };
+
+struct ControlPipe
+{
+  HANDLE hPipe;
+  OVERLAPPED overlapped;
+  ControlPipeStage stage;
+  char request[CONTROL_BUFFER_SIZE];
+  char reply[CONTROL_BUFFER_SIZE];
+};
+
+// ConnectControlPipe
+// Drops any current client and starts an overlapped wait for the next one. The
+// pipe's event is signalled once a client connects, including one that connected
+// before this call.
+void ConnectControlPipe(ControlPipe * pPipe)
+{
+  DisconnectNamedPipe(pPipe -> hPipe);
+  pPipe -> stage = CP_CONNECTING;
+  if(!ConnectNamedPipe(pPipe -> hPipe, &pPipe -> overlapped))
+  {
+    DWORD error = GetLastError();
+    if(error == ERROR_PIPE_CONNECTED)
+    {
+      SetEvent(pPipe -> overlapped.hEvent);
+    }
+    else if(error != ERROR_IO_PENDING)
+    {
+      // Leave the event unsignalled, which takes the pipe out of service
+      #if LOGGING
+      printf("ERROR: ConnectNamedPipe failed with error code %ld\n", error);
+      #endif
+    }
+  }
+}
+
+// OpenControlPipe
+// Creates the control pipe and starts waiting for a client. Returns false if the
+// pipe could not be created, for example because another instance owns the name.
+bool OpenControlPipe(ControlPipe * pPipe)
+{
+  ZeroMemory(pPipe, sizeof(ControlPipe));
+  pPipe -> overlapped.hEvent = CreateEvent(NULL, true, false, NULL);
+  if(!pPipe -> overlapped.hEvent)
+  {
+    #if LOGGING
+    printf("ERROR: Creation of control pipe event failed.\n");
+    #endif
+    return false;
+  }
+  pPipe -> hPipe = CreateNamedPipeA(
+    controlPipeName,
+    PIPE_ACCESS_DUPLEX | FILE_FLAG_OVERLAPPED | FILE_FLAG_FIRST_PIPE_INSTANCE,
+    PIPE_TYPE_MESSAGE | PIPE_READMODE_MESSAGE | PIPE_WAIT | PIPE_REJECT_REMOTE_CLIENTS,
+    1,
+    CONTROL_BUFFER_SIZE,
+    CONTROL_BUFFER_SIZE,
+    0,
+    NULL
+  );
+  if(pPipe -> hPipe == INVALID_HANDLE_VALUE)
+  {
+    #if LOGGING
+    printf("ERROR: CreateNamedPipe failed with error code %ld\n", GetLastError());
+    #endif
+    CloseHandle(pPipe -> overlapped.hEvent);
+    return false;
+  }
+  ConnectControlPipe(pPipe);
+  return true;
+}
+
+void CloseControlPipe(ControlPipe * pPipe)
+{
+  CancelIo(pPipe -> hPipe);
+  DisconnectNamedPipe(pPipe -> hPipe);
+  CloseHandle(pPipe -> hPipe);
+  CloseHandle(pPipe -> overlapped.hEvent);
+}
+
+// Sets *pEvent to the focus event a command feeds to the state machine. Returns
+// false if it feeds none.
+bool CommandFocusEvent(const char * command, FocusEvent * pEvent)
+{
+  if(!strcmp(command, "pause")) { *pEvent = FE_PAUSE; }
+  else if(!strcmp(command, "resume")) { *pEvent = FE_RESUME; }
+  else if(!strcmp(command, "refresh") || !strcmp(command, "release")) { *pEvent = FE_REFRESH; }
+  else { return false; }
+  return true;
+}
+
+// HandleControlCommand
+// Writes the reply to a command into pPipe -> reply. Returns true and sets *pEvent
+// if the command needs to be fed to the focus state machine.
+bool HandleControlCommand(ControlPipe * pPipe, FocusState state, ProcessIdentity appliedProcess, FocusEvent * pEvent)
+{
+  // Ignore trailing whitespace, so that clients can send lines
+  char * command = pPipe -> request;
+  size_t length = strlen(command);
+  while(length && isspace((unsigned char) command[length - 1])) { command[--length] = 0; }
+
+  engineStats.controlCommands++;
+  bool hasEvent = false;
+  if(!strcmp(command, "status"))
+  {
+    EnterCriticalSection(&hashmapCriticalSection);
+    size_t sessionCount = sessionStore.count;
+    DWORD crossCount = sessionStore.crossProcess.count;
+    size_t overrideCount = sessionStore.overrideCount;
+    LeaveCriticalSection(&hashmapCriticalSection);
+    sprintf_s(pPipe -> reply, CONTROL_BUFFER_SIZE,
+      "state %s\nunmuted_process %lu\nunmuted_process_start %llu\nsessions %zu\ncross_process_sessions %lu\noverrides %zu\n",
+      focusStateNames[state], appliedProcess.processId, appliedProcess.startTime, sessionCount, crossCount, overrideCount);
+  }
+  else if(!strcmp(command, "stats"))
+  {
+    sprintf_s(pPipe -> reply, CONTROL_BUFFER_SIZE,
+      "focus_changes %lld\ncoalesced_changes %lld\nswitches_applied %lld\nswitches_held %lld\nrefreshes %lld\ncontrol_commands %lld\n"
+      "window_cache_hits %lld\nwindow_cache_misses %lld\nwindow_lookup_saved_ms %.3f\ntransient_filtered %lld\nsessions_restored %lld\n"
+      "journal_undone %lld\njournal_compactions %lld\n",
+      engineStats.focusChanges, engineStats.coalescedChanges, engineStats.switchesApplied,
+      engineStats.switchesHeld, engineStats.refreshes, engineStats.controlCommands,
+      engineStats.windowCacheHits, engineStats.windowCacheMisses, WindowLookupSavedSeconds() * 1000.0,
+      engineStats.transientFiltered, engineStats.sessionsRestored,
+      engineStats.journalUndone, engineStats.journalCompactions);
+  }
+  else if(CommandFocusEvent(command, pEvent) && LookupFocusTransition(state, *pEvent).action == FA_REJECT)
+  {
+    sprintf_s(pPipe -> reply, CONTROL_BUFFER_SIZE, "error not valid while %s\n", focusStateNames[state]);
+  }
+  else if(!strcmp(command, "pause") || !strcmp(command, "resume") || !strcmp(command, "refresh"))
+  {
+    hasEvent = true;
+    sprintf_s(pPipe -> reply, CONTROL_BUFFER_SIZE, "ok\n");
+  }
+  else if(!strcmp(command, "release"))
+  {
+    // Hand the user's overrides back to the engine, and apply focus to them
+    EnterCriticalSection(&hashmapCriticalSection);
+    size_t released = ReleaseOverrides();
+    LeaveCriticalSection(&hashmapCriticalSection);
+    hasEvent = true;
+    sprintf_s(pPipe -> reply, CONTROL_BUFFER_SIZE, "released %zu\n", released);
+  }
+  else
+  {
+    sprintf_s(pPipe -> reply, CONTROL_BUFFER_SIZE, "error unknown command\n");
+  }
+  return hasEvent;
+}
+
+// ServiceControlPipe
+// Advances the pipe by one step once its event has been signalled. Returns true
+// and sets *pEvent if a command produced an event for the focus state machine.
+bool ServiceControlPipe(ControlPipe * pPipe, FocusState state, ProcessIdentity appliedProcess, FocusEvent * pEvent)
+{
+  DWORD transferred = 0;
+  bool hasEvent = false;
+  if(!GetOverlappedResult(pPipe -> hPipe, &pPipe -> overlapped, &transferred, false))
+  {
+    // Client went away, or sent a message too long to be a command
+    ConnectControlPipe(pPipe);
+    return false;
+  }
+
+  if(pPipe -> stage == CP_READING)
+  {
+    pPipe -> request[transferred] = 0;
+    hasEvent = HandleControlCommand(pPipe, state, appliedProcess, pEvent);
+    pPipe -> stage = CP_WRITING;
+    if(!WriteFile(pPipe -> hPipe, pPipe -> reply, (DWORD) strlen(pPipe -> reply), NULL, &pPipe -> overlapped)
+      && GetLastError() != ERROR_IO_PENDING)
+    {
+      ConnectControlPipe(pPipe);
+    }
+    return hasEvent;
+  }
+
+  // Connected or reply written, wait for the next command
+  pPipe -> stage = CP_READING;
+  if(!ReadFile(pPipe -> hPipe, pPipe -> request, CONTROL_BUFFER_SIZE - 1, NULL, &pPipe -> overlapped)
+    && GetLastError() != ERROR_IO_PENDING)
+  {
+    ConnectControlPipe(pPipe);
+  }
+  return false;
+}
+
+// Metrics exporter
+// Serves the engine counters in the Prometheus text format over HTTP on a
+// loopback-only socket. Like the control pipe, the sockets are non-blocking and
+// signal an event in the audio thread's wait loop, and one scrape is served at a
+// time; anything else that connects meanwhile is dropped.
+struct MetricsServer
+{
+  SOCKET listenSocket;
+  SOCKET clientSocket;
+  WSAEVENT hEvent;
+};
+
+void AppendMetricsLine(string * pOut, const char * format, ...)
+{
+  char line[256];
+  va_list args;
+  va_start(args, format);
+  vsnprintf(line, sizeof(line), format, args);
+  va_end(args);
+  pOut -> append(line);
+}
+
+void AppendCounter(string * pOut, const char * name, const char * help, LONG64 value)
+{
+  AppendMetricsLine(pOut, "# HELP %s %s\n# TYPE %s counter\n%s %lld\n", name, help, name, name, value);
+}
+
+// RenderMetrics
+// Formats every metric into *pOut. pendingChanges is the number of published
+// focus changes which haven't been applied or superseded yet.
+void RenderMetrics(string * pOut, LONG64 pendingChanges)
+{
+  EnterCriticalSection(&hashmapCriticalSection);
+  size_t sessionCount = sessionStore.count;
+  size_t mutedCount = sessionStore.mutedCount;
+  size_t metadataBytes = sessionArena.totalBytes;
+  size_t metadataLiveBytes = sessionArena.liveBytes;
+  size_t metadataBlocks = sessionArena.blocks.size();
+  size_t windowCount = sessionStore.byWindow.size();
+  size_t groupCount = sessionStore.byGroup.size();
+  DWORD crossCount = sessionStore.crossProcess.count;
+  size_t overrideCount = sessionStore.overrideCount;
+  LeaveCriticalSection(&hashmapCriticalSection);
+
+  AppendCounter(pOut, "automute_focus_events_total", "Focus changes received from the focus source.", engineStats.focusChanges);
+  AppendCounter(pOut, "automute_focus_events_coalesced_total", "Focus changes superseded before they were applied.", engineStats.coalescedChanges);
+  AppendCounter(pOut, "automute_switches_applied_total", "Mute switches applied.", engineStats.switchesApplied);
+  AppendCounter(pOut, "automute_engine_wakeups_total", "Passes of the audio thread's wait loop.", engineStats.wakeups);
+  AppendCounter(pOut, "automute_game_mode_entries_total", "Times a fullscreen window took focus.", engineStats.gameModeEntries);
+  AppendCounter(pOut, "automute_desktop_switches_total", "Virtual desktop switches applied in desktop mode.", engineStats.desktopSwitches);
+  AppendCounter(pOut, "automute_switches_held_total", "Switches held back because the focused app was silent.", engineStats.switchesHeld);
+  AppendCounter(pOut, "automute_refreshes_total", "Forced refreshes of every session.", engineStats.refreshes);
+  AppendCounter(pOut, "automute_session_regroupings_total", "Sessions moved to another group.", engineStats.regroupings);
+  AppendCounter(pOut, "automute_backend_calls_total", "Audio backend calls issued.", engineStats.backendCalls);
+  AppendCounter(pOut, "automute_backend_failures_total", "Audio backend calls which failed.", engineStats.backendFailures);
+  AppendCounter(pOut, "automute_volume_echoes_total", "Volume callbacks for changes made by the engine.", engineStats.echoedChanges);
+  AppendCounter(pOut, "automute_volume_external_changes_total", "Volume callbacks for changes made by anyone else.", engineStats.externalChanges);
+  AppendCounter(pOut, "automute_window_cache_hits_total", "Focus changes to a window already in the window cache.", engineStats.windowCacheHits);
+  AppendCounter(pOut, "automute_window_cache_misses_total", "Focus changes to a window seen for the first time.", engineStats.windowCacheMisses);
+  AppendCounter(pOut, "automute_focus_events_transient_total", "Focus changes to transient windows, ignored.", engineStats.transientFiltered);
+  AppendMetricsLine(pOut, "# HELP automute_window_lookup_seconds_total Time spent looking up windows on a cache miss.\n# TYPE automute_window_lookup_seconds_total counter\n");
+  AppendMetricsLine(pOut, "automute_window_lookup_seconds_total %.6f\n", engineStats.windowLookupTicks / engineClock -> TicksPerSecond());
+  // An estimate from the average miss, which can fall as misses get cheaper
+  AppendMetricsLine(pOut, "# HELP automute_window_lookup_saved_seconds Estimated time the window cache has saved.\n# TYPE automute_window_lookup_saved_seconds gauge\n");
+  AppendMetricsLine(pOut, "automute_window_lookup_saved_seconds %.6f\n", WindowLookupSavedSeconds());
+  AppendCounter(pOut, "automute_sessions_restored_total", "Sessions that took over a decision from the previous instance.", engineStats.sessionsRestored);
+  AppendCounter(pOut, "automute_journal_undone_total", "Mutes left by a previous instance and undone from the journal.", engineStats.journalUndone);
+  AppendCounter(pOut, "automute_journal_compactions_total", "Times the full mute journal was rewritten.", engineStats.journalCompactions);
+  AppendCounter(pOut, "automute_control_commands_total", "Commands served on the control pipe.", engineStats.controlCommands);
+  AppendCounter(pOut, "automute_metrics_scrapes_total", "Requests served by this exporter.", engineStats.metricsScrapes);
+
+  AppendMetricsLine(pOut, "# HELP automute_sessions_tracked Audio sessions tracked per device.\n# TYPE automute_sessions_tracked gauge\n");
+  AppendMetricsLine(pOut, "automute_sessions_tracked{device=\"default\"} %zu\n", sessionCount);
+  AppendMetricsLine(pOut, "# HELP automute_sessions_muted Audio sessions muted by the engine.\n# TYPE automute_sessions_muted gauge\n");
+  AppendMetricsLine(pOut, "automute_sessions_muted %zu\n", mutedCount);
+  AppendMetricsLine(pOut, "# HELP automute_sessions_cross_process Tracked sessions shared by several processes.\n# TYPE automute_sessions_cross_process gauge\n");
+  AppendMetricsLine(pOut, "automute_sessions_cross_process %lu\n", crossCount);
+  AppendMetricsLine(pOut, "# HELP automute_sessions_overridden Sessions left alone after the user changed them.\n# TYPE automute_sessions_overridden gauge\n");
+  AppendMetricsLine(pOut, "automute_sessions_overridden %zu\n", overrideCount);
+  AppendMetricsLine(pOut, "# HELP automute_windows_indexed Windows that sessions may be attributed to.\n# TYPE automute_windows_indexed gauge\n");
+  AppendMetricsLine(pOut, "automute_windows_indexed %zu\n", windowCount);
+  AppendMetricsLine(pOut, "# HELP automute_session_groups Groups of sessions muted as one unit.\n# TYPE automute_session_groups gauge\n");
+  AppendMetricsLine(pOut, "automute_session_groups %zu\n", groupCount);
+  AppendMetricsLine(pOut, "# HELP automute_session_metadata_bytes Session metadata arena size, and the part owned by tracked sessions.\n# TYPE automute_session_metadata_bytes gauge\n");
+  AppendMetricsLine(pOut, "automute_session_metadata_bytes{kind=\"allocated\"} %zu\n", metadataBytes);
+  AppendMetricsLine(pOut, "automute_session_metadata_bytes{kind=\"live\"} %zu\n", metadataLiveBytes);
+  AppendMetricsLine(pOut, "# HELP automute_session_metadata_blocks Blocks allocated by the session metadata arena.\n# TYPE automute_session_metadata_blocks gauge\n");
+  AppendMetricsLine(pOut, "automute_session_metadata_blocks %zu\n", metadataBlocks);
+  AppendMetricsLine(pOut, "# HELP automute_game_mode Whether a fullscreen window has focus.\n# TYPE automute_game_mode gauge\n");
+  AppendMetricsLine(pOut, "automute_game_mode %d\n", gameMode ? 1 : 0);
+  FILETIME creation, exit, kernel, user;
+  if(GetProcessTimes(GetCurrentProcess(), &creation, &exit, &kernel, &user))
+  {
+    // FILETIME counts 100 ns units
+    ULONGLONG cpuTime = ((ULONGLONG) kernel.dwHighDateTime << 32 | kernel.dwLowDateTime)
+      + ((ULONGLONG) user.dwHighDateTime << 32 | user.dwLowDateTime);
+    AppendMetricsLine(pOut, "# HELP process_cpu_seconds_total User and kernel CPU time.\n# TYPE process_cpu_seconds_total counter\n");
+    AppendMetricsLine(pOut, "process_cpu_seconds_total %.3f\n", cpuTime / 1e7);
+  }
+  AppendMetricsLine(pOut, "# HELP automute_pending_focus_changes Focus changes waiting to be applied.\n# TYPE automute_pending_focus_changes gauge\n");
+  AppendMetricsLine(pOut, "automute_pending_focus_changes %lld\n", pendingChanges);
+
+  AppendMetricsLine(pOut, "# HELP automute_stage_latency_seconds Latency of each stage of a focus switch.\n# TYPE automute_stage_latency_seconds histogram\n");
+  for(int stage = 0; stage < LS_STAGE_COUNT; stage++)
+  {
+    LatencyHistogram * pHistogram = &engineStats.latency[stage];
+    for(int i = 0; i < LATENCY_BUCKET_COUNT; i++)
+    {
+      AppendMetricsLine(pOut, "automute_stage_latency_seconds_bucket{stage=\"%s\",le=\"%g\"} %lld\n",
+        latencyStageNames[stage], latencyBucketBounds[i], pHistogram -> buckets[i]);
+    }
+    AppendMetricsLine(pOut, "automute_stage_latency_seconds_bucket{stage=\"%s\",le=\"+Inf\"} %lld\n",
+      latencyStageNames[stage], pHistogram -> count);
+    AppendMetricsLine(pOut, "automute_stage_latency_seconds_sum{stage=\"%s\"} %.9f\n",
+      latencyStageNames[stage], pHistogram -> sum);
+    AppendMetricsLine(pOut, "automute_stage_latency_seconds_count{stage=\"%s\"} %lld\n",
+      latencyStageNames[stage], pHistogram -> count);
+  }
+}
+
+// OpenMetricsServer
+// Starts Winsock and listens on 127.0.0.1:METRICS_PORT + seatId. Returns false if the
+// socket could not be set up, in which case nothing needs to be cleaned up.
+bool OpenMetricsServer(MetricsServer * pServer)
+{
+  WSADATA wsaData;
+  int error = WSAStartup(MAKEWORD(2, 2), &wsaData);
+  if(error)
+  {
+    #if LOGGING
+    printf("ERROR: WSAStartup failed with error code %d\n", error);
+    #endif
+    return false;
+  }
+
+  pServer -> clientSocket = INVALID_SOCKET;
+  pServer -> hEvent = WSACreateEvent();
+  pServer -> listenSocket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+  if(pServer -> hEvent == WSA_INVALID_EVENT || pServer -> listenSocket == INVALID_SOCKET)
+  {
+    #if LOGGING
+    printf("ERROR: Creation of metrics socket failed with error code %d\n", WSAGetLastError());
+    #endif
+    if(pServer -> listenSocket != INVALID_SOCKET) { closesocket(pServer -> listenSocket); }
+    if(pServer -> hEvent != WSA_INVALID_EVENT) { WSACloseEvent(pServer -> hEvent); }
+    WSACleanup();
+    return false;
+  }
+
+  sockaddr_in address = {};
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  address.sin_port = htons((unsigned short) (METRICS_PORT + seatId));
+  if(bind(pServer -> listenSocket, (sockaddr *) &address, sizeof(address))
+    || listen(pServer -> listenSocket, 4)
+    || WSAEventSelect(pServer -> listenSocket, pServer -> hEvent, FD_ACCEPT))
+  {
+    #if LOGGING
+    printf("ERROR: Metrics socket setup failed with error code %d\n", WSAGetLastError());
+    #endif
+    closesocket(pServer -> listenSocket);
+    WSACloseEvent(pServer -> hEvent);
+    WSACleanup();
+    return false;
+  }
+  return true;
+}
+
+void CloseMetricsServer(MetricsServer * pServer)
+{
+  if(pServer -> clientSocket != INVALID_SOCKET) { closesocket(pServer -> clientSocket); }
+  closesocket(pServer -> listenSocket);
+  WSACloseEvent(pServer -> hEvent);
+  WSACleanup();
+}
+
+// ServiceMetricsServer
+// Accepts a pending connection and answers a pending request, whichever the
+// event was signalled for. Any request is answered with the metrics.
+void ServiceMetricsServer(MetricsServer * pServer, LONG64 pendingChanges)
+{
+  // Reset the shared event once, up front, so that anything arriving on either
+  // socket while this runs signals it again
+  WSANETWORKEVENTS events;
+  WSAResetEvent(pServer -> hEvent);
+  if(!WSAEnumNetworkEvents(pServer -> listenSocket, NULL, &events)
+    && (events.lNetworkEvents & FD_ACCEPT))
+  {
+    SOCKET client = accept(pServer -> listenSocket, NULL, NULL);
+    if(client != INVALID_SOCKET)
+    {
+      if(pServer -> clientSocket != INVALID_SOCKET
+        || WSAEventSelect(client, pServer -> hEvent, FD_READ | FD_CLOSE))
+      {
+        closesocket(client);
+      }
+      else
+      {
+        pServer -> clientSocket = client;
+      }
+    }
+  }
+
+  if(pServer -> clientSocket == INVALID_SOCKET) { return; }
+  if(WSAEnumNetworkEvents(pServer -> clientSocket, NULL, &events)) { return; }
+  if(events.lNetworkEvents & FD_READ)
+  {
+    // The request itself doesn't matter, only that it arrived
+    char request[1024];
+    recv(pServer -> clientSocket, request, sizeof(request), 0);
+
+    string body;
+    RenderMetrics(&body, pendingChanges);
+    engineStats.metricsScrapes++;
+    string response;
+    AppendMetricsLine(&response,
+      "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n",
+      body.size());
+    response.append(body);
+    // A fresh socket's send buffer takes the whole response; if it doesn't, the
+    // scrape is cut short rather than holding up the audio thread
+    send(pServer -> clientSocket, response.data(), (int) response.size(), 0);
+  }
+  if(events.lNetworkEvents & (FD_READ | FD_CLOSE))
+  {
+    closesocket(pServer -> clientSocket);
+    pServer -> clientSocket = INVALID_SOCKET;
+  }
+}
+
+// SetGameMode
+// Enters game mode when a fullscreen window has focus, after its mute changes
+// have been applied, and leaves it when one doesn't. Game mode silences the
+// per-event log, skips metadata fetches and arena compaction, and runs the
+// audio thread below normal priority. Called by the audio thread only.
+void SetGameMode(bool on)
+{
+  if(on == gameMode) { return; }
+  // Logged from whichever side of the switch isn't silenced
+  if(on) { EventLog("Game mode on.\n"); }
+  gameMode = on;
+  if(!on) { EventLog("Game mode off.\n"); }
+  SetThreadPriority(GetCurrentThread(), on ? THREAD_PRIORITY_BELOW_NORMAL : THREAD_PRIORITY_NORMAL);
+  if(on) { engineStats.gameModeEntries++; }
+}
+
+// OpenStatusBlock
+// Creates the status mapping and maps it for writing. The status block is only
+// an aid to monitoring, so failure is logged and otherwise ignored.
+void OpenStatusBlock()
+{
+  hStatusMapping = CreateFileMappingA(
+    INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0, sizeof(StatusBlock), statusMappingName);
+  if(!hStatusMapping)
+  {
+    #if LOGGING
+    printf("ERROR: CreateFileMapping for status block failed with error code %ld\n", GetLastError());
+    #endif
+    return;
+  }
+  pStatusBlock = (StatusBlock *) MapViewOfFile(hStatusMapping, FILE_MAP_WRITE, 0, 0, sizeof(StatusBlock));
+  if(!pStatusBlock)
+  {
+    #if LOGGING
+    printf("ERROR: MapViewOfFile for status block failed with error code %ld\n", GetLastError());
+    #endif
+    CloseHandle(hStatusMapping);
+    hStatusMapping = NULL;
+    return;
+  }
+  pStatusBlock -> sequence = 0;
+  pStatusBlock -> version = STATUS_BLOCK_VERSION;
+  // Written last, so readers ignore the block until it is usable
+  InterlockedExchange((volatile LONG *) &pStatusBlock -> magic, STATUS_BLOCK_MAGIC);
+}
+
+void CloseStatusBlock()
+{
+  if(!pStatusBlock) { return; }
+  UnmapViewOfFile(pStatusBlock);
+  CloseHandle(hStatusMapping);
+  pStatusBlock = NULL;
+  hStatusMapping = NULL;
+}
+
+// PublishStatus
+// Copies the current engine state into the status block under its seqlock.
+void PublishStatus(FocusState state, ProcessIdentity focusedProcess)
+{
+  if(!pStatusBlock) { return; }
+
+  EnterCriticalSection(&hashmapCriticalSection);
+  size_t sessionCount = sessionStore.count;
+  size_t mutedCount = sessionStore.mutedCount;
+  LeaveCriticalSection(&hashmapCriticalSection);
+
+  // Odd while writing; the interlocked increments are full barriers
+  InterlockedIncrement(&pStatusBlock -> sequence);
+  pStatusBlock -> focusState = state;
+  pStatusBlock -> focusedProcessId = focusedProcess.processId;
+  pStatusBlock -> focusedProcessStartTime = focusedProcess.startTime;
+  pStatusBlock -> lastError = engineStats.lastError;
+  pStatusBlock -> mutedSessions = (LONG64) mutedCount;
+  pStatusBlock -> trackedSessions = (LONG64) sessionCount;
+  pStatusBlock -> focusChanges = engineStats.focusChanges;
+  pStatusBlock -> switchesApplied = engineStats.switchesApplied;
+  pStatusBlock -> backendCalls = engineStats.backendCalls;
+  pStatusBlock -> backendFailures = engineStats.backendFailures;
+  pStatusBlock -> updateTime = engineClock -> NowMs();
+  InterlockedIncrement(&pStatusBlock -> sequence);
+}
+
+// RunFocusEngine
+// Runs the focus state machine on the calling thread until the quit event is
+// set, serving the control pipe and metrics exporter alongside. Sessions are
+// fed to the store separately, by AddAudioSession. On a warm start, the focus
+// published beforehand is applied first, in one pass over the restored mute
+// states that only changes the sessions whose decision differs.
+void RunFocusEngine(bool warmStart)
+{
+  // Serve the control pipe and the metrics exporter, if enabled, from the same
+  // wait loop
+  ControlPipe controlPipe;
+  MetricsServer metricsServer;
+  HANDLE waitHandles[4] = {ghEvents[0], ghEvents[1], NULL, NULL};
+  DWORD waitCount = 2;
+  // Indexes of unused handles are past the end, so no wait result can match them
+  DWORD controlIndex = ARRAYSIZE(waitHandles);
+  DWORD metricsIndex = ARRAYSIZE(waitHandles);
+  if(daemonMode && OpenControlPipe(&controlPipe))
+  {
+    controlIndex = waitCount;
+    waitHandles[waitCount++] = controlPipe.overlapped.hEvent;
+  }
+  if(metricsMode && OpenMetricsServer(&metricsServer))
+  {
+    metricsIndex = waitCount;
+    waitHandles[waitCount++] = metricsServer.hEvent;
+  }
+
+  // Desktop mode needs the virtual desktop manager, except for the stand-in
+  // windows of the stress harness
+  if(desktopMode && !stressSeconds)
+  {
+    HRESULT desktopHr = CoCreateInstance(
+        __uuidof(VirtualDesktopManager),
+        NULL,
+        CLSCTX_ALL,
+        __uuidof(IVirtualDesktopManager),
+        (void **) &pDesktopManager
+    );
+    if(desktopHr != S_OK)
+    {
+      #if LOGGING
+      printf("ERROR: CoCreateInstance for the virtual desktop manager failed with code %ld, desktop mode is off.\n", desktopHr);
+      #endif
+      pDesktopManager = NULL;
+      desktopMode = false;
+    }
+  }
+
+  OpenStatusBlock();
+  PublishStatus(FS_IDLE, noProcess);
+
+  // Run the focus state machine until the quit event is set. The work event means
+  // a new focus snapshot may have been published, a timeout means the debounce
+  // timer expired, the control and metrics handles mean those have work, and
+  // anything else means either the quit event has been set (array index 1) or
+  // something bizarrely wrong has happened.
+  FocusState focusState = FS_IDLE;
+  ULONGLONG debounceDeadline = 0;
+  bool debounceArmed = false;
+  // The process whose sessions were last unmuted, the snapshot it came from, and
+  // the newest snapshot read
+  ProcessIdentity appliedProcess = noProcess;
+  HWND appliedWindow = NULL;
+  LONG64 appliedSequence = 0;
+  FocusSnapshot pendingFocus = {0, {0, 0}, NULL, 0, 0};
+  // When the newest snapshot was read, for the debounce stage latency
+  LONGLONG pendingTicks = 0;
+  if(warmStart)
+  {
+    ReadFocus(&pendingFocus);
+    if(pendingFocus.sequence)
+    {
+      ReconcileMuteStates(pendingFocus.process, pendingFocus.hwnd);
+      appliedProcess = pendingFocus.process;
+      appliedWindow = pendingFocus.hwnd;
+      appliedSequence = pendingFocus.sequence;
+      engineStats.focusChanges = pendingFocus.sequence;
+      PublishStatus(focusState, appliedProcess);
+    }
+  }
+  while(focusState != FS_STOPPED)
+  {
+    FocusEvent event;
+    DWORD waitResult = engineClock -> Wait(waitCount, waitHandles,
+      debounceArmed ? debounceDeadline : NO_DEADLINE);
+    engineStats.wakeups++;
+    if(waitResult == WAIT_OBJECT_0)
+    {
+      // Only the newest snapshot matters; any changes published in between have
+      // already been superseded
+      FocusSnapshot snapshot;
+      ReadFocus(&snapshot);
+      if(stressSeconds) { CheckFocusSnapshot(snapshot, pendingFocus.sequence); }
+      bool focusChanged = snapshot.sequence != pendingFocus.sequence;
+      if(focusChanged)
+      {
+        pendingFocus = snapshot;
+        engineStats.focusChanges = snapshot.sequence;
+        ObserveLatency(LS_DISPATCH, snapshot.publishTicks);
+        pendingTicks = engineClock -> NowTicks();
+      }
+      // A process starting to play retries a held switch, like a focus change
+      bool activated = InterlockedExchange(&activationRequested, 0)
+        && (pendingFocus.process != appliedProcess || pendingFocus.hwnd != appliedWindow);
+      // A refresh applies the newest focus as well, so it covers both. One
+      // requested while paused is kept for after the resume.
+      if(focusState != FS_PAUSED && InterlockedExchange(&refreshRequested, 0)) { event = FE_REFRESH; }
+      else if(focusChanged || activated) { event = FE_FOCUS_CHANGED; }
+      else { continue; }
+    }
+    else if(waitResult == WAIT_OBJECT_0 + controlIndex)
+    {
+      if(!ServiceControlPipe(&controlPipe, focusState, appliedProcess, &event)) { continue; }
+      // A refresh requested while paused is made once resumed
+      if(event == FE_RESUME && ReadAcquire(&refreshRequested)) { SetEvent(ghEvents[0]); }
+    }
+    else if(waitResult == WAIT_OBJECT_0 + metricsIndex)
+    {
+      ServiceMetricsServer(&metricsServer, pendingFocus.sequence - appliedSequence);
+      continue;
+    }
+    else if(waitResult == WAIT_TIMEOUT)
+    {
+      event = FE_DEBOUNCE_EXPIRED;
+    }
+    else
+    {
+      event = FE_QUIT;
+    }
+
+    switch(DispatchFocusEvent(&focusState, event))
+    {
+    case FA_ARM_DEBOUNCE:
+      debounceDeadline = engineClock -> NowMs() + FOCUS_DEBOUNCE_MS;
+      debounceArmed = true;
+      break;
+    case FA_CANCEL_DEBOUNCE:
+      debounceArmed = false;
+      break;
+    case FA_APPLY:
+      debounceArmed = false;
+      // Every snapshot since the last apply was superseded, except the one that
+      // causes a switch now
+      engineStats.coalescedChanges += pendingFocus.sequence - appliedSequence;
+      ObserveLatency(LS_DEBOUNCE, pendingTicks);
+      if(pendingFocus.process != appliedProcess || pendingFocus.hwnd != appliedWindow)
+      {
+        // A held switch retried on activation was counted the first time
+        if(pendingFocus.sequence != appliedSequence) { engineStats.coalescedChanges--; }
+        LONGLONG applyTicks = engineClock -> NowTicks();
+        // A window on another virtual desktop means the desktop was switched,
+        // which is applied to every session in one pass
+        bool desktopSwitched = false;
+        GUID desktop;
+        if(desktopMode && pendingFocus.hwnd && QueryWindowDesktop(pendingFocus.hwnd, &desktop))
+        {
+          EnterCriticalSection(&hashmapCriticalSection);
+          desktopSwitched = NoteWindowDesktop(pendingFocus.process, pendingFocus.hwnd, desktop);
+          LeaveCriticalSection(&hashmapCriticalSection);
+        }
+        bool switched = true;
+        if(desktopSwitched)
+        {
+          ReconcileMuteStates(pendingFocus.process, pendingFocus.hwnd);
+          engineStats.desktopSwitches++;
+        }
+        else { switched = SwitchMuteStates(appliedProcess, pendingFocus.process, pendingFocus.hwnd, keepAudibleMode); }
+        if(switched)
+        {
+          ObserveLatency(LS_APPLY, applyTicks);
+          if(stressSeconds)
+          {
+            CheckSessionInvariants(pendingFocus.process, pendingFocus.hwnd,
+              desktopSwitched ? noProcess : appliedProcess, desktopSwitched);
+          }
+          appliedProcess = pendingFocus.process;
+          appliedWindow = pendingFocus.hwnd;
+          engineStats.switchesApplied++;
+        }
+        else { engineStats.switchesHeld++; }
+      }
+      appliedSequence = pendingFocus.sequence;
+      SetGameMode(pendingFocus.fullscreen);
+      DispatchFocusEvent(&focusState, FE_APPLY_DONE);
+      break;
+    case FA_REFRESH:
+      debounceArmed = false;
+      if(!pendingFocus.sequence)
+      {
+        // Nothing has been focused yet, so every session stays as it is
+        DispatchFocusEvent(&focusState, FE_APPLY_DONE);
+        break;
+      }
+      if(keepAudibleMode)
+      {
+        // Refresh for the app left audible, unless the focused one can be heard
+        EnterCriticalSection(&hashmapCriticalSection);
+        bool focusedActive = ProcessActive(pendingFocus.process);
+        LeaveCriticalSection(&hashmapCriticalSection);
+        if(focusedActive)
+        {
+          appliedProcess = pendingFocus.process;
+          appliedWindow = pendingFocus.hwnd;
+        }
+      }
+      else
+      {
+        appliedProcess = pendingFocus.process;
+        appliedWindow = pendingFocus.hwnd;
+      }
+      RefreshMuteStates(appliedProcess, appliedWindow);
+      if(stressSeconds) { CheckSessionInvariants(appliedProcess, appliedWindow, noProcess, true); }
+      appliedSequence = pendingFocus.sequence;
+      engineStats.refreshes++;
+      SetGameMode(pendingFocus.fullscreen);
+      DispatchFocusEvent(&focusState, FE_APPLY_DONE);
+      break;
+    case FA_REJECT:
+      // Commands are checked before they get here, so this is a bug
+      #if LOGGING
+      printf("ERROR: Focus event %d is not valid while %s\n", event, focusStateNames[focusState]);
+      #endif
+      break;
+    case FA_NONE:
+      break;
+    }
+    PublishStatus(focusState, appliedProcess);
+    ReleaseRetiredSessions();
+  }
+
+  if(controlIndex < waitCount) { CloseControlPipe(&controlPipe); }
+  if(metricsIndex < waitCount) { CloseMetricsServer(&metricsServer); }
+  CloseStatusBlock();
+  if(pDesktopManager)
+  {
+    pDesktopManager -> Release();
+    pDesktopManager = NULL;
+  }
+}
+
+// ClearSessionStore
+// Removes and releases every session, once nothing can add more, and drops the
+// indexes and caches that refer to them.
+void ClearSessionStore()
+{
+  EnterCriticalSection(&hashmapCriticalSection);
+  for(DWORD slot = 0; slot < sessionStore.flags.size(); slot++)
+  {
+    if(sessionStore.flags[slot] & SF_IN_USE) { StoreRemoveSession(slot); }
+  }
+  LeaveCriticalSection(&hashmapCriticalSection);
+  ReleaseRetiredSessions();
+  sessionStore.byWindow.clear();
+  sessionStore.lastWindows.clear();
+  sessionStore.visibleByProcess.clear();
+  decidedGroups.clear();
+  // The device is done with, and its metadata with it
+  sessionIdSet.clear();
+  ArenaReset(&sessionArena);
+  ClearProcessCache();
+}
+
+// Window cache
+// What the focus source knows about each window it has focused, and the root
+// owner of each, filled on first sight and dropped when the window is destroyed,
+// so repeated focus changes between the same windows make no queries. Only the
+// main thread uses it, apart from the audio thread's warm start while the main
+// thread waits for it, so it needs no lock. A window never changes process, and its
+// process can't exit without destroying it, so an entry can't go stale.
+struct CachedWindow
+{
+  ProcessIdentity process; // Owner of the window
+  HWND root;               // Root owner of the window in the same process, or the window
+  DWORD threadId;          // Thread that created the window
+  bool transient;          // Only takes focus briefly; see IsTransientWindow
+  bool fullscreen;         // Covers its whole monitor; see WatchForegroundWindow
+};
+
+unordered_map<HWND, CachedWindow> windowCache;
+// The window in the foreground, and the hook watching it move, which is set on
+// its process alone: location changes come by the thousand from carets and
+// cursors system-wide, and each would be marshalled to the main thread
+HWND foregroundWindow = NULL;
+HWINEVENTHOOK hLocationHook = NULL;
+DWORD locationHookProcessId = 0;
+
+// Classes of windows that take focus only briefly: tooltips, menus, menu
+// shadows, IME windows, XAML popups and the Alt-Tab switcher
+const char * transientWindowClasses[] =
+{
+  "tooltips_class32", "#32768", "SysShadow", "IME", "MSCTFIME UI", "Xaml_WindowedPopupClass",
+  "MultitaskingViewFrame"
+};
+
+// Whether hwnd only takes focus briefly, on top of the app the user is really
+// in, so that following it would mute that app for a moment. Besides the
+// classes above, windows which are not meant to be activated, like toasts, are
+// transient, and so are tool windows which float over an owner, like palettes.
+// A tool window with no owner, or one asking for a taskbar button, may be the
+// whole of a small app, and is followed like any other window.
+bool IsTransientWindow(HWND hwnd)
+{
+  char className[WINDOW_CLASS_SIZE];
+  if(GetClassNameA(hwnd, className, sizeof(className)))
+  {
+    for(size_t i = 0; i < ARRAYSIZE(transientWindowClasses); i++)
+    {
+      if(!strcmp(className, transientWindowClasses[i])) { return true; }
+    }
+  }
+  LONG_PTR exStyle = GetWindowLongPtr(hwnd, GWL_EXSTYLE);
+  if(exStyle & WS_EX_NOACTIVATE) { return true; }
+  return (exStyle & WS_EX_TOOLWINDOW) && !(exStyle & WS_EX_APPWINDOW)
+    && GetWindow(hwnd, GW_OWNER) != NULL;
+}
+
+// Whether hwnd covers the whole of its monitor, like a fullscreen game or video
+bool IsFullscreenWindow(HWND hwnd)
+{
+  if(hwnd == GetDesktopWindow() || hwnd == GetShellWindow()) { return false; }
+  RECT rect;
+  MONITORINFO monitor;
+  monitor.cbSize = sizeof(monitor);
+  if(!GetWindowRect(hwnd, &rect)
+    || !GetMonitorInfo(MonitorFromWindow(hwnd, MONITOR_DEFAULTTONEAREST), &monitor))
+  {
+    return false;
+  }
+  return rect.left <= monitor.rcMonitor.left && rect.top <= monitor.rcMonitor.top
+    && rect.right >= monitor.rcMonitor.right && rect.bottom >= monitor.rcMonitor.bottom;
+}
+
+// Queries hwnd and caches the result, then its root owner if that isn't cached
+// yet. A window which is already gone by then has no thread ID, and isn't cached.
+CachedWindow FillWindow(HWND hwnd)
+{
+  CachedWindow window;
+  DWORD processId = 0;
+  window.threadId = GetWindowThreadProcessId(hwnd, &processId);
+  window.process = ResolveProcessIdentity(processId);
+  // An owned window, like a dialog, plays for the window that owns it, unless
+  // that belongs to another process
+  window.root = GetAncestor(hwnd, GA_ROOTOWNER);
+  DWORD rootProcessId = 0;
+  if(!window.root || window.root == hwnd
+    || !GetWindowThreadProcessId(window.root, &rootProcessId) || rootProcessId != processId)
+  {
+    window.root = hwnd;
+  }
+  window.transient = IsTransientWindow(hwnd);
+  window.fullscreen = !window.transient && IsFullscreenWindow(hwnd);
+  if(window.threadId) { windowCache[hwnd] = window; }
+  // The root is what the window index holds, so its destruction must be seen
+  if(window.threadId && window.root != hwnd && !windowCache.count(window.root))
+  {
+    FillWindow(window.root);
+  }
+  return window;
+}
+
+// Returns the cache entry of hwnd, filling it on first sight. Counts one hit or
+// one miss per call, filling the root owner included.
+CachedWindow LookupWindow(HWND hwnd)
+{
+  auto entry = windowCache.find(hwnd);
+  if(entry != windowCache.end())
+  {
+    engineStats.windowCacheHits++;
+    return entry -> second;
+  }
+  LONGLONG startTicks = engineClock -> NowTicks();
+  CachedWindow window = FillWindow(hwnd);
+  engineStats.windowCacheMisses++;
+  engineStats.windowLookupTicks += engineClock -> NowTicks() - startTicks;
+  return window;
+}
+
+// WatchForegroundWindow
+// Follows hwnd, of processId, as the foreground window, so that its cached
+// fullscreen flag can be kept current: games and videos often go fullscreen
+// some time after taking focus. Moves the location hook to processId if it is
+// on another process. Called on the main thread, from WinEventProc.
+void WatchForegroundWindow(HWND hwnd, DWORD processId, WINEVENTPROC pProc)
+{
+  foregroundWindow = hwnd;
+  if(hLocationHook && processId == locationHookProcessId) { return; }
+  if(hLocationHook) { UnhookWinEvent(hLocationHook); }
+  hLocationHook = processId ? SetWinEventHook(
+     EVENT_OBJECT_LOCATIONCHANGE, EVENT_OBJECT_LOCATIONCHANGE,
+     NULL, pProc, processId, 0,
+     WINEVENT_OUTOFCONTEXT | WINEVENT_SKIPOWNPROCESS) : NULL;
+  locationHookProcessId = hLocationHook ? processId : 0;
+}
+
+// Audio Session monitoring thread
+// Populates the list of all active audio sessions and registers a callbback to add
+// any new sessions created while the program is running
+DWORD WINAPI AudioThreadRoutine(_In_ LPVOID pList)
+{
+
+  HRESULT hr = S_OK;
+  IAudioSessionManager2 * pMgr = NULL;
+  IAudioSessionEnumerator * pEnum = NULL;
+  CSessionNotifier sessionNotifier(NULL);
+  IAudioSessionNotification * pCallback = &sessionNotifier;
+
+  // Initialize COM for this thread
+  hr = CoInitializeEx(NULL, COINIT_MULTITHREADED);
+  if (hr != S_OK)
+  {
+    if (hr == S_FALSE) { CoUninitialize(); }
+    #if LOGGING
+    printf("ERROR: CoInitializeEx failed with code %ld\n", hr);
+    #endif
+    return 2;
+  }
+
+  // The stress harness brings its own stand-in sessions, so no device is opened
+  if(stressSeconds)
+  {
+    SetEvent(ghEvents[0]);
+    EnterSynchronizationBarrier(lpBarrier, 0);
+    if(!recoverMode) { RunFocusEngine(false); }
+    ClearSessionStore();
+    CoUninitialize();
+    return 0;
+  }
+
+  // Initialize the IAudioSeesionManager2 interface
+  hr = GetIAudioSessionManager2(&pMgr);
+  if(hr != S_OK)
+  {
+    // No need for logging here - GetIAudioSessionManager2 logs its own errors.
+    CoUninitialize();
+    return 3;
+  }
+
+  // Sessions added from here on may take over the previous instance's decisions
+  OpenSnapshot();
+
+  //Register callbadk for new audio sessions
+  // Do this first before going through the enumerator, in case new sessions are
+  // created while processing the existing ones
+  hr = pMgr -> RegisterSessionNotification(pCallback);
+  if(hr != S_OK)
+  {
+    CloseSnapshot();
+    pMgr -> Release();
+    CoUninitialize();
+    return 4;
+  }
+
+  // Enumerate all of the existing sessions
+  hr = pMgr -> GetSessionEnumerator(&pEnum);
+  if(hr != S_OK)
+  {
+    #if LOGGING
+    printf("ERROR: GetSessionEnumerator failed with error code %ld\n", hr);
+    #endif
+    pMgr -> UnregisterSessionNotification(pCallback);
+    pMgr -> Release();
+    CloseSnapshot();
+    CoUninitialize();
+    return 5;
+  }
+
+  int numSessions = 0;
+  hr = pEnum -> GetCount(&numSessions);
+  if(hr != S_OK)
+  {
+    #if LOGGING
+    printf("ERROR: Enumerator -> GetCount failed with error code: %ld\n", hr);
+    #endif
+    pMgr -> UnregisterSessionNotification(pCallback);
+    pEnum -> Release();
+    pMgr -> Release();
+    CloseSnapshot();
+    CoUninitialize();
+    return 6;
+  }
+
+  #if LOGGING
+  printf("Preparing to review existing audio sessions. No errors yet.\n");
+  #endif
+  IAudioSessionControl * pCtrl = NULL;
+  IAudioSessionControl2 * pCtrl2 = NULL;
+  for(int i = 0; i < numSessions; i++)
+  {
+    hr = pEnum -> GetSession(i, &pCtrl);
+    if(hr != S_OK) { break; }
+
+    hr = pCtrl -> QueryInterface<IAudioSessionControl2>(&pCtrl2);
+    pCtrl -> Release();
+    if(hr != S_OK) { break; }
+    
+    hr = AddAudioSession(pCtrl2);
+    pCtrl2 -> Release();
+    if(hr != S_OK && hr != AUDCLNT_S_NO_SINGLE_PROCESS) { break; }
+  }
+  pEnum -> Release();
+
+  if(hr != S_OK && hr != AUDCLNT_S_NO_SINGLE_PROCESS)
+  {
+    #if LOGGING
+    printf("ERROR: Problem in enumeration loop, error code: %ld\n", hr);
+    #endif
+    pMgr -> UnregisterSessionNotification(pCallback);
+    pMgr -> Release();
+    CloseSnapshot();
+    CoUninitialize();
+    return 7;
+  }
+
+  // If the previous instance left decisions behind, start from the window in
+  // the foreground now, so the engine can reconcile them with it at once
+  bool warmStart = EndSnapshotRestore();
+  // Then undo whatever else it left muted, should it not have exited cleanly
+  OpenJournal();
+  size_t undone = UndoJournal();
+  if(recoverMode)
+  {
+    printf("Undid %zu mutes left by a previous instance.\n", undone);
+  }
+  // The main thread is waiting for setup, so the window cache may be used here
+  HWND foreground = GetForegroundWindow();
+  if(!recoverMode && warmStart && foreground)
+  {
+    CachedWindow window = LookupWindow(foreground);
+    if(window.threadId) { PublishFocus(window.process, window.root, engineClock -> NowMs(), window.fullscreen); }
+  }
+
+  // Notify the main thread of successful setup and wait
+  SetEvent(ghEvents[0]);
+  EnterSynchronizationBarrier(lpBarrier, 0);
+
+  if(!recoverMode) { RunFocusEngine(warmStart); }
+
+  // End o program cleanup
+  pMgr -> UnregisterSessionNotification(pCallback);
+  pMgr -> Release();
+  // The snapshot keeps the decisions in force for the next instance, so it is
+  // closed before the sessions are let go
+  CloseSnapshot();
+  CloseJournal();
+  ClearSessionStore();
+
+  CoUninitialize();
+  return (DWORD) hr;
+}
+
+// Stand-in audio session
+// Implements the session and volume interfaces that AddAudioSession and the mute
+// functions use, keeping the mute state and volume in memory, and notifies the
+// registered sinks of every change as WASAPI would (on the calling thread, rather
+// than on one of its own). The stress harness and the trace replay run the engine
+// against these, so neither touches a real session. Changes may come from any
+// thread; sinks are notified outside the lock, since they take
+// hashmapCriticalSection, which the audio thread holds across its own calls.
+// The state can be kept outside the session, e.g. in memory shared with another
+// process, to be read back after the session's own process has been killed.
+struct StandInState
+{
+  AudioSessionState state;
+  GUID grouping;
+  BOOL muted;
+  BOOL userMuted;           // The mute state the user last set
+  float level;
+  float userLevel;          // The volume when the user last set the mute state
+};
+
+class CStandInSession : public IAudioSessionControl2, public ISimpleAudioVolume
+{
+    LONG _cRef;
+    DWORD _processId;
+    bool _crossProcess;
+    wstring _instanceId;
+    SRWLOCK _lock;            // Guards everything below
+    StandInState _ownState;
+    StandInState * _pState;   // _ownState, unless kept elsewhere
+    vector<IAudioSessionEvents *> _sinks;
+
+    static HRESULT CopyString(const wstring & text, LPWSTR * ppText)
+    {
+      if(!ppText) { return E_POINTER; }
+      size_t size = (text.size() + 1) * sizeof(WCHAR);
+      *ppText = (LPWSTR) CoTaskMemAlloc(size);
+      if(!*ppText) { return E_OUTOFMEMORY; }
+      memcpy(*ppText, text.c_str(), size);
+      return S_OK;
+    }
+
+    // Copies the sinks with a reference each, under the lock, for notifying
+    // them outside it
+    vector<IAudioSessionEvents *> TakeSinks()
+    {
+      vector<IAudioSessionEvents *> sinks = _sinks;
+      for(auto p = sinks.begin(); p != sinks.end(); ++p) { (*p) -> AddRef(); }
+      return sinks;
+    }
+
+    static void NotifyVolume(vector<IAudioSessionEvents *> & sinks, float level, BOOL muted, LPCGUID EventContext)
+    {
+      for(auto p = sinks.begin(); p != sinks.end(); ++p)
+      {
+        (*p) -> OnSimpleVolumeChanged(level, muted, EventContext);
+        (*p) -> Release();
+      }
+    }
+
+public:
+    // Calls made through ISimpleAudioVolume that left the session as it was
+    volatile LONG64 redundantCalls;
+
+    CStandInSession(DWORD processId, bool crossProcess, const wstring & instanceId,
+                    const GUID & grouping, bool active, bool muted) :
+        _cRef(1),
+        _processId(processId),
+        _crossProcess(crossProcess),
+        _instanceId(instanceId),
+        _pState(&_ownState),
+        redundantCalls(0)
+    {
+        InitializeSRWLock(&_lock);
+        _ownState.state = active ? AudioSessionStateActive : AudioSessionStateInactive;
+        _ownState.grouping = grouping;
+        _ownState.muted = muted;
+        _ownState.userMuted = muted;
+        _ownState.level = 1.0f;
+        _ownState.userLevel = 1.0f;
+    }
+
+    // Keeps the session's state in *pState, taking over whatever it holds
+    CStandInSession(DWORD processId, bool crossProcess, const wstring & instanceId, StandInState * pState) :
+        _cRef(1),
+        _processId(processId),
+        _crossProcess(crossProcess),
+        _instanceId(instanceId),
+        _pState(pState),
+        redundantCalls(0)
+    {
+        InitializeSRWLock(&_lock);
+    }
+
+    ~CStandInSession()
+    {
+    }
+
+    // IUnknown methods -- AddRef, Release, and QueryInterface
+
+    ULONG STDMETHODCALLTYPE AddRef()
+    {
+        return InterlockedIncrement(&_cRef);
+    }
+
+    ULONG STDMETHODCALLTYPE Release()
+    {
+        ULONG ulRef = InterlockedDecrement(&_cRef);
+        if (0 == ulRef)
+        {
+            delete this;
+        }
+        return ulRef;
+    }
+
+    HRESULT STDMETHODCALLTYPE QueryInterface(
+                                REFIID  riid,
+                                VOID  **ppvInterface)
+    {
+        if (IID_IUnknown == riid)
+        {
+            AddRef();
+            *ppvInterface = (IUnknown*)(IAudioSessionControl2*)this;
+        }
+        else if (__uuidof(IAudioSessionControl) == riid || __uuidof(IAudioSessionControl2) == riid)
+        {
+            AddRef();
+            *ppvInterface = (IAudioSessionControl2*)this;
+        }
+        else if (__uuidof(ISimpleAudioVolume) == riid)
+        {
+            AddRef();
+            *ppvInterface = (ISimpleAudioVolume*)this;
+        }
+        else
+        {
+            *ppvInterface = NULL;
+            return E_NOINTERFACE;
+        }
+        return S_OK;
+    }
+
+    // IAudioSessionControl and IAudioSessionControl2 methods
+
+    HRESULT STDMETHODCALLTYPE GetState(AudioSessionState * pState)
+    {
+        AcquireSRWLockShared(&_lock);
+        *pState = _pState -> state;
+        ReleaseSRWLockShared(&_lock);
+        return S_OK;
+    }
+
+    HRESULT STDMETHODCALLTYPE GetDisplayName(LPWSTR * ppName) { return CopyString(_instanceId, ppName); }
+    HRESULT STDMETHODCALLTYPE SetDisplayName(LPCWSTR name, LPCGUID EventContext) { return S_OK; }
+    HRESULT STDMETHODCALLTYPE GetIconPath(LPWSTR * ppPath) { return CopyString(L"", ppPath); }
+    HRESULT STDMETHODCALLTYPE SetIconPath(LPCWSTR path, LPCGUID EventContext) { return S_OK; }
+
+    HRESULT STDMETHODCALLTYPE GetGroupingParam(GUID * pGrouping)
+    {
+        AcquireSRWLockShared(&_lock);
+        *pGrouping = _pState -> grouping;
+        ReleaseSRWLockShared(&_lock);
+        return S_OK;
+    }
+
+    HRESULT STDMETHODCALLTYPE SetGroupingParam(LPCGUID grouping, LPCGUID EventContext)
+    {
+        GUID newGrouping = grouping ? *grouping : GUID_NULL;
+        AcquireSRWLockExclusive(&_lock);
+        _pState -> grouping = newGrouping;
+        vector<IAudioSessionEvents *> sinks = TakeSinks();
+        ReleaseSRWLockExclusive(&_lock);
+        for(auto p = sinks.begin(); p != sinks.end(); ++p)
+        {
+            (*p) -> OnGroupingParamChanged(&newGrouping, EventContext);
+            (*p) -> Release();
+        }
+        return S_OK;
+    }
+
+    HRESULT STDMETHODCALLTYPE RegisterAudioSessionNotification(IAudioSessionEvents * pEvents)
+    {
+        if(!pEvents) { return E_POINTER; }
+        pEvents -> AddRef();
+        AcquireSRWLockExclusive(&_lock);
+        _sinks.push_back(pEvents);
+        ReleaseSRWLockExclusive(&_lock);
+        return S_OK;
+    }
+
+    HRESULT STDMETHODCALLTYPE UnregisterAudioSessionNotification(IAudioSessionEvents * pEvents)
+    {
+        AcquireSRWLockExclusive(&_lock);
+        for(auto p = _sinks.begin(); p != _sinks.end(); ++p)
+        {
+            if(*p == pEvents)
+            {
+                _sinks.erase(p);
+                ReleaseSRWLockExclusive(&_lock);
+                pEvents -> Release();
+                return S_OK;
+            }
+        }
+        ReleaseSRWLockExclusive(&_lock);
+        return E_INVALIDARG;
+    }
+
+    HRESULT STDMETHODCALLTYPE GetSessionIdentifier(LPWSTR * ppId) { return CopyString(_instanceId, ppId); }
+    HRESULT STDMETHODCALLTYPE GetSessionInstanceIdentifier(LPWSTR * ppId) { return CopyString(_instanceId, ppId); }
+
+    HRESULT STDMETHODCALLTYPE GetProcessId(DWORD * pProcessId)
+    {
+        *pProcessId = _crossProcess ? 0 : _processId;
+        return _crossProcess ? AUDCLNT_S_NO_SINGLE_PROCESS : S_OK;
+    }
+
+    HRESULT STDMETHODCALLTYPE IsSystemSoundsSession() { return S_FALSE; }
+    HRESULT STDMETHODCALLTYPE SetDuckingPreference(BOOL optOut) { return S_OK; }
+
+    // ISimpleAudioVolume methods
+
+    HRESULT STDMETHODCALLTYPE SetMasterVolume(float level, LPCGUID EventContext)
+    {
+        AcquireSRWLockExclusive(&_lock);
+        if(level == _pState -> level) { InterlockedIncrement64(&redundantCalls); }
+        _pState -> level = level;
+        BOOL muted = _pState -> muted;
+        vector<IAudioSessionEvents *> sinks = TakeSinks();
+        ReleaseSRWLockExclusive(&_lock);
+        NotifyVolume(sinks, level, muted, EventContext);
+        return S_OK;
+    }
+
+    HRESULT STDMETHODCALLTYPE GetMasterVolume(float * pLevel)
+    {
+        AcquireSRWLockShared(&_lock);
+        *pLevel = _pState -> level;
+        ReleaseSRWLockShared(&_lock);
+        return S_OK;
+    }
+
+    HRESULT STDMETHODCALLTYPE SetMute(BOOL mute, LPCGUID EventContext)
+    {
+        AcquireSRWLockExclusive(&_lock);
+        if(!mute == !_pState -> muted) { InterlockedIncrement64(&redundantCalls); }
+        _pState -> muted = mute;
+        float level = _pState -> level;
+        vector<IAudioSessionEvents *> sinks = TakeSinks();
+        ReleaseSRWLockExclusive(&_lock);
+        NotifyVolume(sinks, level, mute, EventContext);
+        return S_OK;
+    }
+
+    HRESULT STDMETHODCALLTYPE GetMute(BOOL * pMute)
+    {
+        AcquireSRWLockShared(&_lock);
+        *pMute = _pState -> muted;
+        ReleaseSRWLockShared(&_lock);
+        return S_OK;
+    }
+
+    // Changes that come from outside the engine
+
+    void ChangeState(AudioSessionState state)
+    {
+        AcquireSRWLockExclusive(&_lock);
+        _pState -> state = state;
+        vector<IAudioSessionEvents *> sinks = TakeSinks();
+        ReleaseSRWLockExclusive(&_lock);
+        for(auto p = sinks.begin(); p != sinks.end(); ++p)
+        {
+            (*p) -> OnStateChanged(state);
+            (*p) -> Release();
+        }
+    }
+
+    // The user can only toggle the mute, as in the volume mixer, so setting it
+    // as it already is changes nothing and notifies no one
+    void UserSetMute(BOOL mute)
+    {
+        AcquireSRWLockExclusive(&_lock);
+        if(!mute == !_pState -> muted)
+        {
+            ReleaseSRWLockExclusive(&_lock);
+            return;
+        }
+        _pState -> muted = mute;
+        _pState -> userMuted = mute;
+        // The user takes the session over at whatever volume it has
+        float level = _pState -> level;
+        _pState -> userLevel = level;
+        vector<IAudioSessionEvents *> sinks = TakeSinks();
+        ReleaseSRWLockExclusive(&_lock);
+        NotifyVolume(sinks, level, mute, NULL);
+    }
+
+    // The app or the user setting the session's volume, leaving its mute as it is
+    void UserSetVolume(float level)
+    {
+        AcquireSRWLockExclusive(&_lock);
+        _pState -> level = level;
+        _pState -> userLevel = level;
+        BOOL muted = _pState -> muted;
+        vector<IAudioSessionEvents *> sinks = TakeSinks();
+        ReleaseSRWLockExclusive(&_lock);
+        NotifyVolume(sinks, level, muted, NULL);
+    }
+
+    DWORD ProcessId() { return _processId; }
+
+    bool Expired()
+    {
+        AudioSessionState state;
+        GetState(&state);
+        return state == AudioSessionStateExpired;
+    }
+
+    // Whether the session is as its user left it, with nothing of ours in force
+    bool InOwnState()
+    {
+        AcquireSRWLockShared(&_lock);
+        bool own = !_pState -> muted == !_pState -> userMuted && _pState -> level == _pState -> userLevel;
+        ReleaseSRWLockShared(&_lock);
+        return own;
+    }
+};
+
+// Creates a stand-in session of processId for the stress harness, starting out
+// active or not at random, and adds it as the creation callback would
+void AddStressSession(vector<CStandInSession *> * pSessions, DWORD processId, bool crossProcess)
+{
+  // Every session created gets an instance ID of its own, as WASAPI's do
+  wstring instanceId = L"stress." + to_wstring(processId) + L"." + to_wstring(pSessions -> size());
+  CStandInSession * pSession = new CStandInSession(processId, crossProcess, instanceId,
+    GUID_NULL, rand() % 2 == 0, false);
+  pSessions -> push_back(pSession);
+  AddAudioSession(pSession);
+}
+
+// Stress publisher thread
+// Publishes bursts of random focus changes until the stress run ends, besides
+// those of the harness thread, so that several writers contend for the focus
+// seqlock. Each checks that the sequence numbers it is given strictly increase,
+// and that every snapshot it reads back is whole. Publishers don't set the work
+// event, so a simulated clock can still settle; the engine reads their snapshots
+// whenever the harness wakes it.
+DWORD WINAPI StressPublisherRoutine(_In_ LPVOID pParam)
+{
+  ULONGLONG endTime = *(ULONGLONG *) pParam;
+  LONG64 lastSequence = 0;
+  while(GetTickCount64() < endTime)
+  {
+    int burst = 1 + rand() % STRESS_MAX_BURST;
+    for(int i = 0; i < burst; i++)
+    {
+      ProcessIdentity process = ResolveProcessIdentity(1 + rand() % STRESS_PROCESSES);
+      HWND hwnd = (HWND) (ULONG_PTR) ((ULONGLONG) process.processId * STRESS_WINDOWS_PER_PROCESS
+        + rand() % STRESS_WINDOWS_PER_PROCESS + 1);
+      LONG64 sequence = PublishFocus(process, hwnd, engineClock -> NowMs(), false);
+      InterlockedIncrement64(&stressPublishes);
+      if(sequence <= lastSequence)
+      {
+        printf("INVARIANT: Publisher was given sequence %lld after %lld.\n", sequence, lastSequence);
+        InterlockedIncrement64(&engineStats.invariantViolations);
+      }
+      lastSequence = sequence;
+      FocusSnapshot snapshot;
+      ReadFocus(&snapshot);
+      CheckFocusSnapshot(snapshot, sequence);
+    }
+    Sleep(0);
+  }
+  return 0;
+}
+
+// Stress status reader thread
+// Reads the status block as an external monitor would until the stress run
+// ends: maps it read-only once the audio thread has created it, copies it under
+// the seqlock protocol, and checks that fields written together agree, so a
+// torn copy or an update outside the seqlock shows as a violation.
+DWORD WINAPI StressStatusRoutine(_In_ LPVOID pParam)
+{
+  ULONGLONG endTime = *(ULONGLONG *) pParam;
+  HANDLE hMapping = NULL;
+  const StatusBlock * pBlock = NULL;
+  while(!pBlock && GetTickCount64() < endTime)
+  {
+    hMapping = OpenFileMappingA(FILE_MAP_READ, false, statusMappingName);
+    if(hMapping)
+    {
+      pBlock = (const StatusBlock *) MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, sizeof(StatusBlock));
+      if(!pBlock)
+      {
+        CloseHandle(hMapping);
+        hMapping = NULL;
+      }
+    }
+    if(!pBlock) { Sleep(1); }
+  }
+
+  LONG64 reads = 0, retries = 0, violations = 0;
+  StatusBlock previous = {};
+  while(pBlock && GetTickCount64() < endTime)
+  {
+    if(ReadAcquire((volatile LONG *) &pBlock -> magic) != STATUS_BLOCK_MAGIC)
+    {
+      Sleep(1);
+      continue;
+    }
+    StatusBlock status;
+    LONG seqBefore, seqAfter;
+    for(;;)
+    {
+      seqBefore = ReadAcquire((volatile LONG *) &pBlock -> sequence);
+      memcpy(&status, (const void *) pBlock, sizeof(status));
+      MemoryBarrier();
+      seqAfter = ReadAcquire((volatile LONG *) &pBlock -> sequence);
+      if(!(seqBefore & 1) && seqBefore == seqAfter) { break; }
+      retries++;
+    }
+    reads++;
+    const char * problem = NULL;
+    if(status.focusedProcessStartTime != StandInStartTime(status.focusedProcessId)) { problem = "focused process and start time disagree"; }
+    else if(status.mutedSessions > status.trackedSessions) { problem = "more sessions muted than tracked"; }
+    else if(status.backendFailures > status.backendCalls) { problem = "more backend failures than calls"; }
+    else if(seqBefore < previous.sequence) { problem = "sequence went back"; }
+    else if(status.updateTime < previous.updateTime || status.focusChanges < previous.focusChanges
+      || status.switchesApplied < previous.switchesApplied || status.backendCalls < previous.backendCalls)
+    {
+      problem = "counters went back";
+    }
+    if(problem)
+    {
+      printf("INVARIANT: Status block %ld read with %s.\n", seqBefore, problem);
+      violations++;
+    }
+    previous = status;
+    previous.sequence = seqBefore;
+    if(reads % STRESS_MAX_BURST == 0) { Sleep(0); }
+  }
+  InterlockedAdd64(&engineStats.invariantViolations, violations);
+  printf("Status block read %lld times, %lld retries, %lld inconsistent.\n", reads, retries, violations);
+
+  if(pBlock) { UnmapViewOfFile(pBlock); }
+  if(hMapping) { CloseHandle(hMapping); }
+  return 0;
+}
+
+// Stress harness thread
+// Stands in for the WinEvent hook and for WASAPI for stressSeconds: creates
+// stand-in sessions for a set of stand-in processes, publishes bursts of random
+// focus changes among them (and to processes without sessions), requests
+// refreshes, and changes the sessions as their apps and users would: regrouping
+// them, toggling their activity and mute, expiring some and creating others,
+// and re-adding every one so that AddAudioSession runs concurrently with
+// switching. No real session is touched. The audio thread checks the session
+// invariants at every quiescent point. Reports throughput and quits at the end.
+DWORD WINAPI StressThreadRoutine(_In_ LPVOID pParam)
+{
+  vector<CStandInSession *> sessions;
+  ULONGLONG startTime = GetTickCount64();
+  ULONGLONG endTime = startTime + stressSeconds * 1000ULL;
+  srand((unsigned) startTime);
+  vector<HANDLE> publishers;
+  for(DWORD i = 0; i < stressPublishers; i++)
+  {
+    HANDLE hPublisher = CreateThread(NULL, 0, StressPublisherRoutine, &endTime, 0, NULL);
+    if(hPublisher) { publishers.push_back(hPublisher); }
+  }
+  HANDLE hStatusReader = CreateThread(NULL, 0, StressStatusRoutine, &endTime, 0, NULL);
+  for(DWORD processId = 1; processId <= STRESS_PROCESSES; processId++)
+  {
+    int count = 1 + rand() % STRESS_SESSIONS_PER_PROCESS;
+    for(int i = 0; i < count; i++) { AddStressSession(&sessions, processId, false); }
+  }
+  for(int i = 0; i < STRESS_CROSS_SESSIONS; i++) { AddStressSession(&sessions, 1 + rand() % STRESS_PROCESSES, true); }
+
+  LONG64 focusOps = 0, refreshOps = 0, enumerateOps = 0, destroyOps = 0, regroupOps = 0, bursts = 0;
+  LONG64 stateOps = 0, userOps = 0, expireOps = 0, lastSequence = 0;
+  while(GetTickCount64() < endTime)
+  {
+    if(bursts % STRESS_ENUMERATE_EVERY == 0)
+    {
+      // Replace a session by a new one of another process, then add every
+      // session again: all but the new one are duplicates
+      CStandInSession * pExpired = sessions[rand() % sessions.size()];
+      if(!pExpired -> Expired())
+      {
+        pExpired -> ChangeState(AudioSessionStateExpired);
+        AddStressSession(&sessions, 1 + rand() % STRESS_PROCESSES, false);
+        expireOps++;
+      }
+      for(auto p = sessions.begin(); p != sessions.end(); ++p)
+      {
+        if(!(*p) -> Expired()) { AddAudioSession(*p); }
+      }
+      enumerateOps++;
+    }
+
+    int burst = 1 + rand() % STRESS_MAX_BURST;
+    for(int i = 0; i < burst; i++)
+    {
+      // One in eight focus changes goes to a process with no sessions
+      DWORD processId = rand() % 8 == 0 ? STRESS_PROCESSES + 1 + rand() % STRESS_PROCESSES
+        : 1 + rand() % STRESS_PROCESSES;
+      ProcessIdentity process = ResolveProcessIdentity(processId);
+      // Stand-in window handles; nothing dereferences them, and no hook
+      // reports real ones in stress mode
+      HWND hwnd = (HWND) (ULONG_PTR) ((ULONGLONG) process.processId * STRESS_WINDOWS_PER_PROCESS
+        + rand() % STRESS_WINDOWS_PER_PROCESS + 1);
+      LONG64 sequence = PublishFocus(process, hwnd, engineClock -> NowMs(), false);
+      InterlockedIncrement64(&stressPublishes);
+      if(sequence <= lastSequence)
+      {
+        printf("INVARIANT: Harness was given sequence %lld after %lld.\n", sequence, lastSequence);
+        InterlockedIncrement64(&engineStats.invariantViolations);
+      }
+      lastSequence = sequence;
+      focusOps++;
+      if(rand() % 64 == 0)
+      {
+        // Destroy some other window, as the EVENT_OBJECT_DESTROY hook would
+        HWND destroyed = (HWND) (ULONG_PTR) ((ULONGLONG) process.processId * STRESS_WINDOWS_PER_PROCESS
+          + rand() % STRESS_WINDOWS_PER_PROCESS + 1);
+        if(destroyed != hwnd)
+        {
+          EnterCriticalSection(&hashmapCriticalSection);
+          if(ForgetWindow(destroyed)) { InterlockedExchange(&refreshRequested, 1); }
+          LeaveCriticalSection(&hashmapCriticalSection);
+          destroyOps++;
+        }
+      }
+      CStandInSession * pSession = sessions[rand() % sessions.size()];
+      if(!pSession -> Expired())
+      {
+        if(rand() % 16 == 0)
+        {
+          // Move the session to one of a few groups, or out of its group
+          GUID grouping = GUID_NULL;
+          grouping.Data1 = rand() % (STRESS_GROUPS + 1);
+          if(!grouping.Data1) { grouping = GUID_NULL; }
+          pSession -> SetGroupingParam(&grouping, NULL);
+          regroupOps++;
+        }
+        if(rand() % 16 == 0)
+        {
+          AudioSessionState state;
+          pSession -> GetState(&state);
+          pSession -> ChangeState(state == AudioSessionStateActive ? AudioSessionStateInactive : AudioSessionStateActive);
+          stateOps++;
+        }
+        if(rand() % 64 == 0)
+        {
+          BOOL muted = FALSE;
+          pSession -> GetMute(&muted);
+          pSession -> UserSetMute(!muted);
+          userOps++;
+        }
+      }
+      if(rand() % 32 == 0)
+      {
+        InterlockedExchange(&refreshRequested, 1);
+        refreshOps++;
+      }
+      SetEvent(ghEvents[0]);
+    }
+    bursts++;
+    // Sometimes let focus settle so the burst is applied, sometimes not
+    engineClock -> Sleep(rand() % (2 * FOCUS_DEBOUNCE_MS));
+  }
+
+  // Every publish took the next sequence number, so the last one is the count
+  for(auto p = publishers.begin(); p != publishers.end(); ++p)
+  {
+    WaitForSingleObject(*p, INFINITE);
+    CloseHandle(*p);
+  }
+  if(hStatusReader)
+  {
+    WaitForSingleObject(hStatusReader, INFINITE);
+    CloseHandle(hStatusReader);
+  }
+  FocusSnapshot lastFocus;
+  ReadFocus(&lastFocus);
+  if(lastFocus.sequence != stressPublishes)
+  {
+    printf("INVARIANT: Last focus sequence is %lld after %lld publishes.\n", lastFocus.sequence, stressPublishes);
+    InterlockedIncrement64(&engineStats.invariantViolations);
+  }
+
+  double seconds = (GetTickCount64() - startTime) / 1000.0;
+  EnterCriticalSection(&hashmapCriticalSection);
+  size_t windowCount = sessionStore.byWindow.size();
+  size_t groupCount = sessionStore.byGroup.size();
+  LeaveCriticalSection(&hashmapCriticalSection);
+  printf("Stress run finished after %.1f s: %lld focus changes (%.0f/s), %lld refreshes, %lld enumerations.\n",
+    seconds, focusOps, focusOps / seconds, refreshOps, enumerateOps);
+  if(!publishers.empty())
+  {
+    printf("%zu publisher threads besides, %lld focus changes published in all.\n",
+      publishers.size(), stressPublishes);
+  }
+  printf("%zu stand-in sessions created, %lld expired, %lld activity and %lld user mute changes.\n",
+    sessions.size(), expireOps, stateOps, userOps);
+  printf("%lld window destructions, %zu windows indexed at the end.\n", destroyOps, windowCount);
+  printf("%lld regroupings, %zu groups at the end.\n", regroupOps, groupCount);
+  if(engineClock == &simulatedClock)
+  {
+    printf("Simulated %.1f s of focus changes, %.1fx real time.\n",
+      engineClock -> NowMs() / 1000.0, engineClock -> NowMs() / 1000.0 / seconds);
+  }
+
+  // The engine holds its own references to the sessions it still tracks
+  for(auto p = sessions.begin(); p != sessions.end(); ++p) { (*p) -> Release(); }
+  PostThreadMessage(mainThreadId, WM_QUIT, 0, 0);
+  return 0;
+}
+
+// Event procssing thread routine
+// Runs in a loop and receives event reports from the callback in the main thread
+
+// Callback function for the WinEvent hook
+// This should be as short as possible and just gather and dispatch
+// information to another thread to actually process the event, and
+// try to avoid any COM calls or Windows messaging if possible to
+// reduce the risk of self-interrupting reentrant execution
+// The callback function should have exactly this argument list
+void CALLBACK WinEventProc(
+    HWINEVENTHOOK hWinEventHook,
+    DWORD event,
+    HWND hwnd,
+    LONG idObject,
+    LONG idChild,
+    DWORD dwEventThread,
+    DWORD dwmsEventTime
+)
+{
+  // Check if this is a window change-of-focus event
+  if (
+      hwnd &&
+      idObject == OBJID_WINDOW &&
+      idChild == CHILDID_SELF &&
+      event == EVENT_SYSTEM_FOREGROUND
+  )
+  {
+    // Get the process of the window which gained focus
+    CachedWindow window = LookupWindow(hwnd);
+
+    EventLog("Focus change, window of process %ld thread %ld now has focus.\n", window.process.processId, window.threadId);
+    // Focus returns to the window underneath once a transient window is gone,
+    // which is then the current focus again and needs no switch
+    if(filterTransient && window.transient)
+    {
+      EventLog("This window is transient, ignored.\n");
+      engineStats.transientFiltered++;
+      return;
+    }
+    WatchForegroundWindow(hwnd, window.process.processId, WinEventProc);
+    FocusSnapshot current;
+    ReadFocus(&current);
+    if(window.process == current.process && window.root == current.hwnd
+      && window.fullscreen == current.fullscreen)
+    {
+      return;
+    }
+
+    PublishFocus(window.process, window.root, engineClock -> FromEventTime(dwmsEventTime), window.fullscreen);
+    SetEvent(ghEvents[0]); // Set "work to do" event
+  }
+  else if (
+      hwnd &&
+      hwnd == foregroundWindow &&
+      idObject == OBJID_WINDOW &&
+      idChild == CHILDID_SELF &&
+      event == EVENT_OBJECT_LOCATIONCHANGE
+  )
+  {
+    // The foreground window moved or was resized; if it went in or out of
+    // fullscreen, publish the focus again with the new flag, which the audio
+    // thread then applies to game mode
+    auto entry = windowCache.find(hwnd);
+    if(entry == windowCache.end() || entry -> second.transient) { return; }
+    bool fullscreen = IsFullscreenWindow(hwnd);
+    if(fullscreen == entry -> second.fullscreen) { return; }
+    entry -> second.fullscreen = fullscreen;
+    EventLog("Foreground window of process %ld is %s fullscreen.\n",
+      entry -> second.process.processId, fullscreen ? "now" : "no longer");
+    PublishFocus(entry -> second.process, entry -> second.root, engineClock -> FromEventTime(dwmsEventTime), fullscreen);
+    SetEvent(ghEvents[0]);
+  }
+  else if (
+      hwnd &&
+      idObject == OBJID_WINDOW &&
+      idChild == CHILDID_SELF &&
+      event == EVENT_OBJECT_DESTROY
+  )
+  {
+    // Every window in the system reports its destruction here, but only those
+    // focused, and their root owners, can be in the window index
+    if(!windowCache.erase(hwnd)) { return; }
+    // Sessions of a destroyed window follow their process from now on, which
+    // may unmute them, so have the audio thread refresh if there were any
+    EnterCriticalSection(&hashmapCriticalSection);
+    DWORD detached = ForgetWindow(hwnd);
+    LeaveCriticalSection(&hashmapCriticalSection);
+    if(detached)
+    {
+      InterlockedExchange(&refreshRequested, 1);
+      SetEvent(ghEvents[0]);
+    }
+  }
+}
+
+
+// Main routine
+// Set hook, start processor thread, run message loop, and clean up at end
+// Main function name and arguments should be exactly this
+// Tools that include this file to drive the engine themselves, like the trace
+// replay, define AUTOMUTE_NO_WINMAIN and bring their own entry point
+#ifndef AUTOMUTE_NO_WINMAIN
+int WINAPI WinMain(HINSTANCE hinst, HINSTANCE hinstPrev,
+                   LPSTR lpCmdLine, int nShowCmd)
+{
+
+  setvbuf(stdout, NULL, _IONBF, 0);
+
+  // "/daemon" serves the control pipe so a running instance can be managed
+  daemonMode = lpCmdLine && strstr(lpCmdLine, "/daemon");
+  // "/metrics" serves Prometheus metrics on the loopback interface
+  metricsMode = lpCmdLine && strstr(lpCmdLine, "/metrics");
+  // "/stress:<seconds>" runs the stress harness in place of the WinEvent hook
+  const char * stressArg = lpCmdLine ? strstr(lpCmdLine, "/stress:") : NULL;
+  if(stressArg) { stressSeconds = (DWORD) atoi(stressArg + strlen("/stress:")); }
+  standInProcesses = stressSeconds != 0;
+  // "/publishers:<n>" has n more threads publish focus changes in a stress run
+  const char * publishersArg = lpCmdLine ? strstr(lpCmdLine, "/publishers:") : NULL;
+  if(publishersArg) { stressPublishers = (DWORD) atoi(publishersArg + strlen("/publishers:")); }
+  // "/duck:<percent>" lowers background sessions to that percentage of their
+  // volume instead of muting them
+  const char * duckArg = lpCmdLine ? strstr(lpCmdLine, "/duck:") : NULL;
+  if(duckArg)
+  {
+    int percent = atoi(duckArg + strlen("/duck:"));
+    if(percent >= 0 && percent < 100)
+    {
+      duckMode = true;
+      duckFraction = percent / 100.0f;
+    }
+  }
+  // "/desktop" keeps every app with a window on the visible virtual desktop audible
+  desktopMode = lpCmdLine && strstr(lpCmdLine, "/desktop");
+  // "/keepaudible" leaves the background app audible while the focused app is silent
+  keepAudibleMode = lpCmdLine && strstr(lpCmdLine, "/keepaudible");
+  // "/nofilter" follows focus to transient windows too
+  filterTransient = !(lpCmdLine && strstr(lpCmdLine, "/nofilter"));
+  // "/recover" undoes the mutes a crashed instance left behind, and exits
+  recoverMode = lpCmdLine && strstr(lpCmdLine, "/recover");
+  // "/crossproc:service" or "/crossproc:app=<file.exe>" lets cross-process
+  // sessions follow focus, which they otherwise never do
+  const char * crossArg = lpCmdLine ? strstr(lpCmdLine, "/crossproc:") : NULL;
+  if(crossArg)
+  {
+    crossArg += strlen("/crossproc:");
+    if(!strncmp(crossArg, "service", strlen("service"))) { crossProcessPolicy = CP_FOLLOW_SERVICE; }
+    else if(!strncmp(crossArg, "app=", strlen("app=")))
+    {
+      crossArg += strlen("app=");
+      size_t length = strcspn(crossArg, " ");
+      if(length && length < MAX_PATH)
+      {
+        memcpy(followedAppName, crossArg, length);
+        followedAppName[length] = 0;
+        crossProcessPolicy = CP_FOLLOW_APP;
+      }
+    }
+  }
+  // "/simclock" runs the engine on simulated time, for the stress harness. Only
+  // the harness advances that time; with the real hook, debounces never expire.
+  if(lpCmdLine && strstr(lpCmdLine, "/simclock"))
+  {
+    if(!stressSeconds)
+    {
+      printf("ERROR: /simclock is only valid with /stress.\n");
+      return 1;
+    }
+    engineClock = &simulatedClock;
+  }
+  // "/seat:<n>" overrides the seat, to run several instances side by side on
+  // one desktop, e.g. stress runs measuring aggregate throughput
+  const char * seatArg = lpCmdLine ? strstr(lpCmdLine, "/seat:") : NULL;
+  if(seatArg) { seatId = (DWORD) atoi(seatArg + strlen("/seat:")); }
+  else if(!ProcessIdToSessionId(GetCurrentProcessId(), &seatId)) { seatId = 0; }
+  sprintf_s(workEventName, SEAT_NAME_SIZE, "AutoMuteWork.%lu", seatId);
+  sprintf_s(quitEventName, SEAT_NAME_SIZE, "AutoMuteQuit.%lu", seatId);
+  sprintf_s(controlPipeName, SEAT_NAME_SIZE, "%s.%lu", CONTROL_PIPE_NAME, seatId);
+  sprintf_s(statusMappingName, SEAT_NAME_SIZE, "%s.%lu", STATUS_MAPPING_NAME, seatId);
+  // The session snapshot lives in the temp directory, one per seat. The stress
+  // harness runs without one, so its runs don't depend on each other.
+  DWORD tempLength = stressSeconds ? 0 : GetTempPathA(MAX_PATH, snapshotPath);
+  if(tempLength && tempLength + SEAT_NAME_SIZE < MAX_PATH)
+  {
+    sprintf_s(snapshotPath + tempLength, MAX_PATH - tempLength, "%s.%lu", SNAPSHOT_FILE_NAME, seatId);
+    memcpy(journalPath, snapshotPath, tempLength);
+    sprintf_s(journalPath + tempLength, MAX_PATH - tempLength, "%s.%lu", JOURNAL_FILE_NAME, seatId);
+  }
+  else
+  {
+    snapshotPath[0] = 0;
+    journalPath[0] = 0;
+  }
+  mainThreadId = GetCurrentThreadId();
+
+  InitializeCriticalSection(&hashmapCriticalSection);
+  // A fresh context per run, so a previous instance's changes aren't mistaken
+  // for ours
+  if(CoCreateGuid(&engineEventContext) != S_OK)
+  {
+    #if LOGGING
+    printf("ERROR: Creation of the event context failed.\n");
+    #endif
+    return 1;
+  }
+
+  ghEvents[0] = CreateEvent(NULL, false, false, workEventName);
+  if(!ghEvents[0])
+  {
+    #if LOGGING
+    printf("ERROR: Creation of work event failed.\n");
+    #endif
+    return 1;
+  }
+  if(GetLastError() == ERROR_ALREADY_EXISTS)
+  {
+    // Two instances on one seat would fight over every session
+    printf("ERROR: Already running on seat %lu.\n", seatId);
+    CloseHandle(ghEvents[0]);
+    return 1;
+  }
+  ghEvents[1] = CreateEvent(NULL, true, false, quitEventName);
+  if(!ghEvents[1])
+  {
+    #if LOGGING
+    printf("ERROR: Creation of quit event failed.\n");
+    #endif
+    return 1;
+  }
+
+  if(!InitializeSynchronizationBarrier(lpBarrier,2,-1))
+  {
+    #if LOGGING
+    printf("ERROR: Creation of synchronization barrier failed.\n");
+    #endif
+    return 1;
+  }
+
+  // Start audio session tracking thread
+  HANDLE hAudioThread = CreateThread(NULL, 0, AudioThreadRoutine, NULL, 0, NULL);
+  if(!hAudioThread)
+  {
+    #if LOGGING
+    printf("ERROR: Failed to start audio session tracking thread.\n");
+    #endif
+    return 2;
+  }
+
+  // Wait for other threads to finish setup.
+  // Wait for the thread itself as well as the ready event, in case the thread aborts
+
+  // Will replace this with ghEvents, with the work event set if thread 2 is ready
+  // or the quit event set if something went wrong.
+  HANDLE hAudioThreadState[2] = {ghEvents[0], hAudioThread};
+
+  DWORD result = WaitForMultipleObjects(2, hAudioThreadState, false, 20000);
+  if(result != WAIT_OBJECT_0)
+  {
+    #if LOGGING
+    printf("ERROR: Failure or timeout in audio thread, return code: %ld\n", result);
+    #endif
+    return 3;
+  }
+
+  EnterSynchronizationBarrier(lpBarrier, 0);
+  DeleteSynchronizationBarrier(lpBarrier);
+
+  // Recovery is done once the audio thread has undone the journal
+  if(recoverMode)
+  {
+    WaitForSingleObject(hAudioThread, INFINITE);
+    CloseHandle(hAudioThread);
+    return 0;
+  }
+
+  // Set the event hook for the callback function, or start the stress harness
+  HWINEVENTHOOK hWinEventHook = NULL;
+  HWINEVENTHOOK hDestroyEventHook = NULL;
+  HANDLE hStressThread = NULL;
+  if(stressSeconds)
+  {
+    hStressThread = CreateThread(NULL, 0, StressThreadRoutine, NULL, 0, NULL);
+  }
+  else
+  {
+    hWinEventHook = SetWinEventHook(
+       EVENT_SYSTEM_FOREGROUND, EVENT_SYSTEM_FOREGROUND,
+       NULL, WinEventProc, 0, 0,
+       WINEVENT_OUTOFCONTEXT | WINEVENT_SKIPOWNPROCESS);
+    hDestroyEventHook = SetWinEventHook(
+       EVENT_OBJECT_DESTROY, EVENT_OBJECT_DESTROY,
+       NULL, WinEventProc, 0, 0,
+       WINEVENT_OUTOFCONTEXT | WINEVENT_SKIPOWNPROCESS);
+  }
+
+
+  // Message loop, runs continuously until WM_QUIT or something goes wrong
+  // GetMessage returns a "true" value normally, or a "0" on a WM_QUIT message...
+  // ...or a "-1" (say WHAT, now?!) if some kind of error happens.
+  MSG msg;
+  int b;
+  while ((b = GetMessage(&msg, NULL, 0, 0)) && b != -1) {
+    TranslateMessage(&msg);
+    DispatchMessage(&msg);
+  }
+
+  if (hWinEventHook) UnhookWinEvent(hWinEventHook);
+  if (hDestroyEventHook) UnhookWinEvent(hDestroyEventHook);
+  if (hLocationHook) UnhookWinEvent(hLocationHook);
+  SetEvent(ghEvents[1]); // Set the quit event
+
+  if(hStressThread)
+  {
+    WaitForSingleObject(hStressThread, INFINITE);
+    CloseHandle(hStressThread);
+  }
+  // Let the audio thread finish its last pass, and close the snapshot and the
+  // journal, before reading its counters or exiting
+  WaitForSingleObject(hAudioThread, INFINITE);
+  CloseHandle(hAudioThread);
+  if(stressSeconds)
+  {
+    printf("Invariants checked at %lld quiescent points, %lld violations.\n",
+      engineStats.invariantChecks, engineStats.invariantViolations);
+    printf("%lld backend calls, %lld volume callbacks dropped as echoes, %lld handled as external.\n",
+      engineStats.backendCalls, engineStats.echoedChanges, engineStats.externalChanges);
+  }
+
+  // End event procesing thread
+  return 0;
+}
+#endif
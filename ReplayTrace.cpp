@@ -0,0 +1,660 @@
+// Headless trace replay
+// Runs the focus engine of EventHookProcessID.cpp against a recorded trace of
+// focus and session events, with stand-in audio sessions in place of WASAPI and
+// the simulated clock in place of real time, then reports what the engine did:
+// switches, coalesced focus changes, backend calls, per-stage latency and peak
+// memory. Nothing is hooked, no real session is touched and no real process is
+// opened: the process IDs in a trace name stand-ins, each given a start time of
+// its own, so a trace replays the same way on any machine.
+//
+// Usage: ReplayTrace <trace file> [/duck:<percent>] [/keepaudible] [/crossproc:service]
+//                    [/nofilter] [/snapshot:<file>] [/journal:<file>] [/journallimit:<n>]
+//                    [/crashat:<ms>]
+//
+// A trace is a text file with one event per line, at non-decreasing times in
+// milliseconds from the start of the trace. Blank lines and lines starting with
+// # are ignored.
+//   <ms> session <instance> <pid> [cross] [active] [muted] [group=<n>]
+//   <ms> expire <instance>
+//   <ms> active <instance>
+//   <ms> inactive <instance>
+//   <ms> group <instance> <n>          (0 takes the session out of its group)
+//   <ms> user <instance> mute|unmute   (a change made by the user, not by us)
+//   <ms> volume <instance> <percent>   (the app or the user setting its volume)
+//   <ms> focus <pid> [<hwnd>] [fullscreen] [transient]
+//   <ms> destroy <hwnd>
+//   <ms> refresh
+// Sessions and focus at time 0 are what an instance finds at startup: they are
+// added before the engine starts, as the enumeration adds them. With /snapshot,
+// they take over the decisions a previous replay left in that file, and the
+// engine starts warm; replaying a trace twice with the same file compares a warm
+// start against a cold one.
+// Window handles are stand-in numbers; a focus event without one uses the
+// process ID. Focus changes to transient windows are dropped as the focus
+// source would drop them, unless /nofilter is given; replaying a trace with and
+// without it compares the backend calls the filter saves.
+// With /journal, the engine journals the mutes it applies to that file, and
+// undoes at startup those a previous replay left behind; /journallimit compacts
+// the journal after every n records appended, rather than half a half's worth,
+// so a short trace compacts it too. With /crashat, the replay runs in a child process,
+// which at that time in the trace sets the volume of one session the engine has
+// muted, as an app in the background may, then starts switching focus between
+// the other processes as fast as the engine applies it, and is killed a moment
+// later, whatever it is part way through. This process then recovers as
+// /recover would, from the journal alone, over the sessions the child left
+// behind, and reports how many were left other than as their user last set
+// them, exiting with 3 if any were. The engine's log goes to stdout as usual
+// and the report to stderr, so either can be kept without the other.
+
+#define AUTOMUTE_NO_WINMAIN
+#include "EventHookProcessID.cpp"
+
+// Peak working set for the report
+#include <psapi.h>
+#pragma comment(lib, "psapi.lib")
+
+#define REPLAY_LINE_SIZE 512
+#define REPLAY_CRASH_SESSIONS 4096   // Sessions a crash run can share
+#define REPLAY_INSTANCE_SIZE 64      // Longest instance name in a crash run, with its NUL
+#define REPLAY_KILL_DELAY_MS 50      // Longest the kill comes after the crash time
+#define REPLAY_BURST_LIMIT 1000000   // Focus changes the child makes before giving up on the kill
+#define REPLAY_BENCH_SECONDS 0.1     // Time spent re-dispatching the replay's focus events
+
+// Replay clock
+// Simulated time for the engine's deadlines, so a trace of hours replays in
+// moments, but real time for its latency ticks, so the stage latencies measure
+// the engine's own cost. The debounce stage includes the time taken to advance
+// the clock to its deadline.
+class CReplayClock : public CSimulatedClock
+{
+public:
+    LONGLONG NowTicks() { return realClock.NowTicks(); }
+    double TicksPerSecond() { return realClock.TicksPerSecond(); }
+};
+
+CReplayClock replayClock;
+
+// Crash run
+// The child of a crash run keeps the state of its stand-in sessions in a
+// mapping shared with the parent, so that the parent finds them as the child
+// left them when it was killed, as a new instance finds WASAPI's.
+struct CrashSession
+{
+  char instanceId[REPLAY_INSTANCE_SIZE];
+  DWORD processId;
+  DWORD crossProcess;
+  StandInState state;
+};
+
+enum CrashStage { CS_REPLAYING, CS_BURSTING, CS_BURST_DONE };
+
+struct CrashRun
+{
+  volatile LONG sessionCount;   // Sessions the child has added
+  volatile LONG stage;          // CrashStage the child has reached
+  volatile LONG volumeSession;  // Session given a volume change under the engine's mute, or -1
+  CrashSession sessions[REPLAY_CRASH_SESSIONS];
+};
+
+CrashRun * pCrashRun = NULL;    // Set in the child of a crash run
+
+// Runs the engine until the quit event is set
+DWORD WINAPI ReplayEngineRoutine(_In_ LPVOID pParam)
+{
+  RunFocusEngine(pParam != NULL);
+  return 0;
+}
+
+wstring WidenTrace(const char * text)
+{
+  wstring wide;
+  for(; *text; text++) { wide.push_back((WCHAR) (unsigned char) *text); }
+  return wide;
+}
+
+// Prints the count, mean and approximate percentiles of a stage's latency; each
+// percentile is the bound of the first bucket that reaches it
+void ReportLatency(LatencyStage stage)
+{
+  const LatencyHistogram * pHistogram = &engineStats.latency[stage];
+  fprintf(stderr, "  %-9s %8lld", latencyStageNames[stage], pHistogram -> count);
+  if(!pHistogram -> count)
+  {
+    fprintf(stderr, "\n");
+    return;
+  }
+  fprintf(stderr, "  mean %8.3f ms", pHistogram -> sum * 1000.0 / pHistogram -> count);
+  const double quantiles[3] = {0.5, 0.9, 0.99};
+  const char * quantileNames[3] = {"p50", "p90", "p99"};
+  for(int q = 0; q < 3; q++)
+  {
+    LONG64 rank = (LONG64) (quantiles[q] * pHistogram -> count + 0.5);
+    if(rank < 1) { rank = 1; }
+    int i = 0;
+    while(i < LATENCY_BUCKET_COUNT && pHistogram -> buckets[i] < rank) { i++; }
+    if(i < LATENCY_BUCKET_COUNT) { fprintf(stderr, "  %s <= %g ms", quantileNames[q], latencyBucketBounds[i] * 1000.0); }
+    else { fprintf(stderr, "  %s > %g ms", quantileNames[q], latencyBucketBounds[LATENCY_BUCKET_COUNT - 1] * 1000.0); }
+  }
+  fprintf(stderr, "\n");
+}
+
+// Keeps the benchmark's dispatches from being optimized away
+volatile LONG64 transitionSink = 0;
+
+// Re-dispatches the focus events of the replay, from the idle state the engine
+// started in, for about REPLAY_BENCH_SECONDS, and reports the transitions per
+// second of the replay as a whole and of the state machine alone
+void ReportTransitions(const vector<FocusEvent> & events, double replaySeconds)
+{
+  fprintf(stderr, "%zu state machine transitions, %.0f per second of replay", events.size(),
+    replaySeconds > 0.0 ? events.size() / replaySeconds : 0.0);
+  if(events.empty())
+  {
+    fprintf(stderr, ".\n");
+    return;
+  }
+  LONG64 transitions = 0;
+  LONG64 actions = 0;
+  double seconds;
+  LONGLONG startTicks = realClock.NowTicks();
+  do
+  {
+    FocusState state = FS_IDLE;
+    for(size_t i = 0; i < events.size(); i++) { actions += DispatchFocusEvent(&state, events[i]); }
+    transitions += events.size();
+    seconds = (realClock.NowTicks() - startTicks) / realClock.TicksPerSecond();
+  } while(seconds < REPLAY_BENCH_SECONDS);
+  transitionSink = actions;
+  fprintf(stderr, "; re-dispatched alone, %.1f million per second.\n", transitions / seconds / 1e6);
+}
+
+// Creates a stand-in session for a trace's session event. In the child of a
+// crash run, its state goes in the shared mapping; returns NULL if that is full.
+CStandInSession * CreateReplaySession(const char * instanceId, DWORD processId, bool crossProcess,
+                                      const GUID & grouping, bool active, bool muted)
+{
+  if(!pCrashRun) { return new CStandInSession(processId, crossProcess, WidenTrace(instanceId), grouping, active, muted); }
+  LONG index = pCrashRun -> sessionCount;
+  if(index >= REPLAY_CRASH_SESSIONS || strlen(instanceId) >= REPLAY_INSTANCE_SIZE) { return NULL; }
+  CrashSession * pShared = &pCrashRun -> sessions[index];
+  strncpy_s(pShared -> instanceId, REPLAY_INSTANCE_SIZE, instanceId, _TRUNCATE);
+  pShared -> processId = processId;
+  pShared -> crossProcess = crossProcess;
+  pShared -> state.state = active ? AudioSessionStateActive : AudioSessionStateInactive;
+  pShared -> state.grouping = grouping;
+  pShared -> state.muted = muted;
+  pShared -> state.userMuted = muted;
+  pShared -> state.level = 1.0f;
+  pShared -> state.userLevel = 1.0f;
+  WriteRelease(&pCrashRun -> sessionCount, index + 1);
+  return new CStandInSession(processId, crossProcess, WidenTrace(instanceId), &pShared -> state);
+}
+
+// Sets the volume of a session the engine has muted, leaving the mute as it is.
+// Returns the session's index in the crash run, or -1 if none is muted.
+LONG ChangeMutedVolume(unordered_map<string, CStandInSession *> & sessions)
+{
+  for(LONG i = 0; i < pCrashRun -> sessionCount; i++)
+  {
+    CrashSession * pShared = &pCrashRun -> sessions[i];
+    CStandInSession * pSession = sessions[pShared -> instanceId];
+    if(pShared -> crossProcess || pSession -> Expired() || pSession -> InOwnState()) { continue; }
+    pSession -> UserSetVolume(pShared -> state.level / 2);
+    return i;
+  }
+  return -1;
+}
+
+// Switches focus between the processes of the live sessions other than
+// sparedProcessId, letting each switch be applied before the next, until this
+// process is killed
+void BurstFocus(unordered_map<string, CStandInSession *> & sessions, DWORD sparedProcessId)
+{
+  vector<DWORD> processIds;
+  for(auto p = sessions.begin(); p != sessions.end(); ++p)
+  {
+    DWORD processId = p -> second -> ProcessId();
+    if(!p -> second -> Expired() && processId != sparedProcessId) { processIds.push_back(processId); }
+  }
+  if(processIds.empty()) { return; }
+  for(int i = 0; i < REPLAY_BURST_LIMIT; i++)
+  {
+    DWORD processId = processIds[rand() % processIds.size()];
+    PublishFocus(ResolveProcessIdentity(processId), (HWND) (ULONG_PTR) processId, engineClock -> NowMs(), false);
+    SetEvent(ghEvents[0]);
+    replayClock.AdvanceTo(engineClock -> NowMs() + FOCUS_DEBOUNCE_MS);
+  }
+}
+
+// RunCrashTest
+// Replays the trace in a child process started with the same arguments, kills
+// the child at a random moment shortly after it reaches the crash time, then
+// recovers from the journal over the sessions it left and reports how they
+// were left. Returns the exit code for the replay.
+int RunCrashTest(int argc, char ** argv)
+{
+  char mappingName[SEAT_NAME_SIZE];
+  sprintf_s(mappingName, SEAT_NAME_SIZE, "AutoMuteReplayCrash.%lu", GetCurrentProcessId());
+  HANDLE hMapping = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0, sizeof(CrashRun), mappingName);
+  if(hMapping && GetLastError() == ERROR_ALREADY_EXISTS)
+  {
+    fprintf(stderr, "ERROR: The crash run mapping %s is already in use.\n", mappingName);
+    return 2;
+  }
+  CrashRun * pRun = hMapping ? (CrashRun *) MapViewOfFile(hMapping, FILE_MAP_WRITE, 0, 0, sizeof(CrashRun)) : NULL;
+  if(!pRun)
+  {
+    fprintf(stderr, "ERROR: Creation of the crash run mapping failed with error code %ld.\n", GetLastError());
+    return 2;
+  }
+
+  char modulePath[MAX_PATH];
+  if(!GetModuleFileNameA(NULL, modulePath, MAX_PATH))
+  {
+    fprintf(stderr, "ERROR: GetModuleFileName failed with error code %ld.\n", GetLastError());
+    return 2;
+  }
+  string commandLine = string("\"") + modulePath + "\"";
+  for(int i = 1; i < argc; i++) { commandLine += string(" \"") + argv[i] + "\""; }
+  commandLine += string(" /child:") + mappingName;
+  pRun -> volumeSession = -1;
+  STARTUPINFOA startup = {};
+  startup.cb = sizeof(startup);
+  PROCESS_INFORMATION child = {};
+  if(!CreateProcessA(modulePath, &commandLine[0], NULL, NULL, false, 0, NULL, NULL, &startup, &child))
+  {
+    fprintf(stderr, "ERROR: Starting the replay failed with error code %ld.\n", GetLastError());
+    return 2;
+  }
+
+  // Kill the child at a random point of its burst
+  while(ReadAcquire(&pRun -> stage) == CS_REPLAYING)
+  {
+    if(WaitForSingleObject(child.hProcess, 1) == WAIT_OBJECT_0)
+    {
+      fprintf(stderr, "ERROR: The replay ended before the crash time.\n");
+      return 2;
+    }
+  }
+  srand(GetTickCount());
+  DWORD killDelay = rand() % (REPLAY_KILL_DELAY_MS + 1);
+  Sleep(killDelay);
+  TerminateProcess(child.hProcess, 1);
+  WaitForSingleObject(child.hProcess, INFINITE);
+  CloseHandle(child.hThread);
+  CloseHandle(child.hProcess);
+  if(ReadAcquire(&pRun -> stage) == CS_BURST_DONE)
+  {
+    fprintf(stderr, "ERROR: The replay finished its burst before it was killed.\n");
+    return 2;
+  }
+
+  // Recover as a /recover instance would: from the sessions the child left
+  // and the journal, with nothing of the killed engine's state
+  vector<CStandInSession *> sessions;
+  CStandInSession * pVolumeSession = NULL;
+  size_t changedAtKill = 0;
+  LONGLONG recoveryTicks = realClock.NowTicks();
+  recoverMode = true;
+  OpenSnapshot();
+  LONG sessionCount = ReadAcquire(&pRun -> sessionCount);
+  for(LONG i = 0; i < sessionCount; i++)
+  {
+    CrashSession * pShared = &pRun -> sessions[i];
+    if(pShared -> state.state == AudioSessionStateExpired) { continue; }
+    CStandInSession * pSession = new CStandInSession(pShared -> processId, pShared -> crossProcess != 0,
+      WidenTrace(pShared -> instanceId), &pShared -> state);
+    if(!pSession -> InOwnState()) { changedAtKill++; }
+    if(i == pRun -> volumeSession) { pVolumeSession = pSession; }
+    AddAudioSession(pSession);
+    sessions.push_back(pSession);
+  }
+  OpenJournal();
+  LONG journalRecords = pJournal ? JournalCount(pJournal -> head) : 0;
+  size_t undone = UndoJournal();
+  double recoverySeconds = (realClock.NowTicks() - recoveryTicks) / realClock.TicksPerSecond();
+  size_t notOwnState = 0;
+  for(auto p = sessions.begin(); p != sessions.end(); ++p)
+  {
+    if(!(*p) -> InOwnState()) { notOwnState++; }
+  }
+
+  fprintf(stderr, "Killed %lu ms after the crash time, with %zu of %zu live sessions changed by the engine.\n",
+    killDelay, changedAtKill, sessions.size());
+  fprintf(stderr, "Recovery read %ld journal records and undid %zu in %.3f ms with %lld backend calls.\n",
+    journalRecords, undone, recoverySeconds * 1000.0, engineStats.backendCalls);
+  if(pVolumeSession)
+  {
+    fprintf(stderr, "Session %s, its volume set under the engine's mute, was %s.\n",
+      pRun -> sessions[pRun -> volumeSession].instanceId,
+      pVolumeSession -> InOwnState() ? "left as its user set it" : "left muted");
+  }
+  fprintf(stderr, "%zu live sessions left other than as their user set them.\n", notOwnState);
+
+  CloseSnapshot();
+  CloseJournal();
+  ClearSessionStore();
+  for(auto p = sessions.begin(); p != sessions.end(); ++p) { (*p) -> Release(); }
+  UnmapViewOfFile(pRun);
+  CloseHandle(hMapping);
+  return notOwnState ? 3 : 0;
+}
+
+int main(int argc, char ** argv)
+{
+  setvbuf(stdout, NULL, _IONBF, 0);
+
+  const char * tracePath = NULL;
+  const char * childMappingName = NULL;
+  ULONGLONG crashTime = 0;
+  bool crashRequested = false;
+  for(int i = 1; i < argc; i++)
+  {
+    if(!strncmp(argv[i], "/duck:", strlen("/duck:")))
+    {
+      int percent = atoi(argv[i] + strlen("/duck:"));
+      if(percent >= 0 && percent < 100)
+      {
+        duckMode = true;
+        duckFraction = percent / 100.0f;
+      }
+    }
+    else if(!strcmp(argv[i], "/keepaudible")) { keepAudibleMode = true; }
+    else if(!strcmp(argv[i], "/crossproc:service")) { crossProcessPolicy = CP_FOLLOW_SERVICE; }
+    else if(!strcmp(argv[i], "/nofilter")) { filterTransient = false; }
+    else if(!strncmp(argv[i], "/snapshot:", strlen("/snapshot:")))
+    {
+      strncpy_s(snapshotPath, MAX_PATH, argv[i] + strlen("/snapshot:"), _TRUNCATE);
+    }
+    else if(!strncmp(argv[i], "/journal:", strlen("/journal:")))
+    {
+      strncpy_s(journalPath, MAX_PATH, argv[i] + strlen("/journal:"), _TRUNCATE);
+    }
+    else if(!strncmp(argv[i], "/journallimit:", strlen("/journallimit:")))
+    {
+      int limit = atoi(argv[i] + strlen("/journallimit:"));
+      if(limit > 0 && limit <= JOURNAL_CAPACITY) { journalLimit = limit; }
+    }
+    else if(!strncmp(argv[i], "/crashat:", strlen("/crashat:")))
+    {
+      crashTime = _strtoui64(argv[i] + strlen("/crashat:"), NULL, 10);
+      crashRequested = true;
+    }
+    else if(!strncmp(argv[i], "/child:", strlen("/child:"))) { childMappingName = argv[i] + strlen("/child:"); }
+    else { tracePath = argv[i]; }
+  }
+  if(!tracePath)
+  {
+    fprintf(stderr, "Usage: %s <trace file> [/duck:<percent>] [/keepaudible] [/crossproc:service] [/nofilter] [/snapshot:<file>] [/journal:<file>] [/journallimit:<n>] [/crashat:<ms>]\n", argv[0]);
+    return 1;
+  }
+  if(crashRequested && !journalPath[0])
+  {
+    fprintf(stderr, "ERROR: /crashat is only valid with /journal.\n");
+    return 1;
+  }
+  FILE * pTrace = NULL;
+  if(fopen_s(&pTrace, tracePath, "r") || !pTrace)
+  {
+    fprintf(stderr, "ERROR: Can't open trace %s.\n", tracePath);
+    return 1;
+  }
+
+  engineClock = &replayClock;
+  standInProcesses = true;
+  InitializeCriticalSection(&hashmapCriticalSection);
+  if(CoCreateGuid(&engineEventContext) != S_OK)
+  {
+    fprintf(stderr, "ERROR: Creation of the event context failed.\n");
+    return 1;
+  }
+  // Unnamed, so a replay can run alongside an instance on the same seat
+  ghEvents[0] = CreateEvent(NULL, false, false, NULL);
+  ghEvents[1] = CreateEvent(NULL, true, false, NULL);
+  if(!ghEvents[0] || !ghEvents[1])
+  {
+    fprintf(stderr, "ERROR: Creation of the work and quit events failed.\n");
+    return 1;
+  }
+  if(crashRequested && !childMappingName)
+  {
+    fclose(pTrace);
+    return RunCrashTest(argc, argv);
+  }
+  if(childMappingName)
+  {
+    HANDLE hCrashMapping = OpenFileMappingA(FILE_MAP_WRITE, false, childMappingName);
+    if(hCrashMapping) { pCrashRun = (CrashRun *) MapViewOfFile(hCrashMapping, FILE_MAP_WRITE, 0, 0, sizeof(CrashRun)); }
+    if(!pCrashRun)
+    {
+      fprintf(stderr, "ERROR: Opening the crash run mapping failed with error code %ld.\n", GetLastError());
+      return 2;
+    }
+  }
+  OpenSnapshot();
+  OpenJournal();
+  vector<FocusEvent> focusEvents;
+  pFocusEventLog = &focusEvents;
+
+  // Each event is applied once the engine has handled everything due before it,
+  // and the engine is settled again before the next, so a replay is repeatable
+  unordered_map<string, CStandInSession *> sessions;
+  char line[REPLAY_LINE_SIZE];
+  int lineNumber = 0;
+  LONG64 replayed = 0, skipped = 0;
+  HANDLE hEngineThread = NULL;
+  LONGLONG startTicks = realClock.NowTicks();
+  double startupSeconds = 0.0;
+  LONG64 startupCalls = 0;
+  size_t startupSessions = 0;
+  for(;;)
+  {
+    bool haveLine = fgets(line, sizeof(line), pTrace) != NULL;
+    char * context = NULL;
+    char * timeField = haveLine ? strtok_s(line, " \t\r\n", &context) : NULL;
+    char * kind = timeField && timeField[0] != '#' ? strtok_s(NULL, " \t\r\n", &context) : NULL;
+    ULONGLONG eventTime = kind ? _strtoui64(timeField, NULL, 10) : 0;
+    bool startup = eventTime == 0 && kind && (!strcmp(kind, "session") || !strcmp(kind, "focus"));
+    if(!hEngineThread && (!haveLine || (kind && !startup)))
+    {
+      // Startup is over: reconcile, if warm, and time it up to when the engine
+      // is waiting for the first event
+      bool warmStart = EndSnapshotRestore();
+      UndoJournal();
+      startupSessions = sessions.size();
+      hEngineThread = CreateThread(NULL, 0, ReplayEngineRoutine, warmStart ? (LPVOID) 1 : NULL, 0, NULL);
+      if(!hEngineThread)
+      {
+        fprintf(stderr, "ERROR: Failed to start the engine thread.\n");
+        return 2;
+      }
+      replayClock.Settle();
+      startupSeconds = (realClock.NowTicks() - startTicks) / realClock.TicksPerSecond();
+      startupCalls = engineStats.backendCalls;
+    }
+    if(!haveLine) { break; }
+    lineNumber++;
+    if(!timeField || timeField[0] == '#') { continue; }
+    char * first = kind ? strtok_s(NULL, " \t\r\n", &context) : NULL;
+    if(!kind)
+    {
+      fprintf(stderr, "Line %d: no event, skipped.\n", lineNumber);
+      skipped++;
+      continue;
+    }
+    if(eventTime < engineClock -> NowMs())
+    {
+      fprintf(stderr, "Line %d: time goes backwards, skipped.\n", lineNumber);
+      skipped++;
+      continue;
+    }
+    if(pCrashRun && eventTime > crashTime)
+    {
+      // The parent kills this process from here on, part way through the burst
+      replayClock.AdvanceTo(crashTime);
+      LONG volumeSession = ChangeMutedVolume(sessions);
+      replayClock.Settle();
+      WriteRelease(&pCrashRun -> volumeSession, volumeSession);
+      WriteRelease(&pCrashRun -> stage, CS_BURSTING);
+      BurstFocus(sessions, volumeSession >= 0 ? pCrashRun -> sessions[volumeSession].processId : 0);
+      WriteRelease(&pCrashRun -> stage, CS_BURST_DONE);
+      break;
+    }
+    if(hEngineThread) { replayClock.AdvanceTo(eventTime); }
+
+    CStandInSession * pSession = NULL;
+    bool sessionEvent = !strcmp(kind, "expire") || !strcmp(kind, "active") || !strcmp(kind, "inactive")
+      || !strcmp(kind, "group") || !strcmp(kind, "user") || !strcmp(kind, "volume");
+    if(sessionEvent)
+    {
+      auto entry = first ? sessions.find(first) : sessions.end();
+      if(entry == sessions.end())
+      {
+        fprintf(stderr, "Line %d: unknown session, skipped.\n", lineNumber);
+        skipped++;
+        continue;
+      }
+      pSession = entry -> second;
+    }
+
+    if(!strcmp(kind, "session"))
+    {
+      char * processField = strtok_s(NULL, " \t\r\n", &context);
+      if(!first || !processField || sessions.count(first))
+      {
+        fprintf(stderr, "Line %d: bad or duplicate session, skipped.\n", lineNumber);
+        skipped++;
+        continue;
+      }
+      bool crossProcess = false, active = false, muted = false;
+      GUID grouping = GUID_NULL;
+      for(char * option; (option = strtok_s(NULL, " \t\r\n", &context)); )
+      {
+        if(!strcmp(option, "cross")) { crossProcess = true; }
+        else if(!strcmp(option, "active")) { active = true; }
+        else if(!strcmp(option, "muted")) { muted = true; }
+        else if(!strncmp(option, "group=", strlen("group="))) { grouping.Data1 = strtoul(option + strlen("group="), NULL, 10); }
+      }
+      pSession = CreateReplaySession(first, strtoul(processField, NULL, 10), crossProcess, grouping, active, muted);
+      if(!pSession)
+      {
+        fprintf(stderr, "Line %d: too many sessions, or too long a name, for a crash run, skipped.\n", lineNumber);
+        skipped++;
+        continue;
+      }
+      sessions[first] = pSession;
+      AddAudioSession(pSession);
+    }
+    else if(!strcmp(kind, "expire")) { pSession -> ChangeState(AudioSessionStateExpired); }
+    else if(!strcmp(kind, "active")) { pSession -> ChangeState(AudioSessionStateActive); }
+    else if(!strcmp(kind, "inactive")) { pSession -> ChangeState(AudioSessionStateInactive); }
+    else if(!strcmp(kind, "group"))
+    {
+      char * groupField = strtok_s(NULL, " \t\r\n", &context);
+      GUID grouping = GUID_NULL;
+      if(groupField) { grouping.Data1 = strtoul(groupField, NULL, 10); }
+      pSession -> SetGroupingParam(&grouping, NULL);
+    }
+    else if(!strcmp(kind, "user"))
+    {
+      char * muteField = strtok_s(NULL, " \t\r\n", &context);
+      pSession -> UserSetMute(muteField && !strcmp(muteField, "mute"));
+    }
+    else if(!strcmp(kind, "volume"))
+    {
+      char * levelField = strtok_s(NULL, " \t\r\n", &context);
+      pSession -> UserSetVolume(levelField ? atoi(levelField) / 100.0f : 1.0f);
+    }
+    else if(!strcmp(kind, "focus") && first)
+    {
+      DWORD processId = strtoul(first, NULL, 10);
+      HWND hwnd = (HWND) (ULONG_PTR) processId;
+      bool fullscreen = false, transient = false;
+      for(char * option; (option = strtok_s(NULL, " \t\r\n", &context)); )
+      {
+        if(!strcmp(option, "fullscreen")) { fullscreen = true; }
+        else if(!strcmp(option, "transient")) { transient = true; }
+        else { hwnd = (HWND) (ULONG_PTR) _strtoui64(option, NULL, 10); }
+      }
+      if(filterTransient && transient) { engineStats.transientFiltered++; }
+      else
+      {
+        PublishFocus(ResolveProcessIdentity(processId), hwnd, engineClock -> NowMs(), fullscreen);
+        SetEvent(ghEvents[0]);
+      }
+    }
+    else if(!strcmp(kind, "destroy") && first)
+    {
+      EnterCriticalSection(&hashmapCriticalSection);
+      DWORD detached = ForgetWindow((HWND) (ULONG_PTR) _strtoui64(first, NULL, 10));
+      LeaveCriticalSection(&hashmapCriticalSection);
+      if(detached)
+      {
+        InterlockedExchange(&refreshRequested, 1);
+        SetEvent(ghEvents[0]);
+      }
+    }
+    else if(!strcmp(kind, "refresh"))
+    {
+      InterlockedExchange(&refreshRequested, 1);
+      SetEvent(ghEvents[0]);
+    }
+    else
+    {
+      fprintf(stderr, "Line %d: unknown or incomplete %s event, skipped.\n", lineNumber, kind);
+      skipped++;
+      continue;
+    }
+    if(hEngineThread) { replayClock.Settle(); }
+    replayed++;
+  }
+  fclose(pTrace);
+
+  // Let a pending debounce expire, then stop the engine
+  replayClock.AdvanceTo(engineClock -> NowMs() + FOCUS_DEBOUNCE_MS);
+  ULONGLONG traceTime = engineClock -> NowMs();
+  SetEvent(ghEvents[1]);
+  WaitForSingleObject(hEngineThread, INFINITE);
+  CloseHandle(hEngineThread);
+  double seconds = (realClock.NowTicks() - startTicks) / realClock.TicksPerSecond();
+  pFocusEventLog = NULL;
+
+  LONG64 redundantCalls = 0;
+  for(auto p = sessions.begin(); p != sessions.end(); ++p) { redundantCalls += p -> second -> redundantCalls; }
+
+  fprintf(stderr, "Replayed %lld events (%lld skipped) covering %.1f s of trace in %.2f s.\n",
+    replayed, skipped, traceTime / 1000.0, seconds);
+  fprintf(stderr, "Startup took %.2f ms: %zu sessions, %lld restored from the snapshot, %lld backend calls.\n",
+    startupSeconds * 1000.0, startupSessions, engineStats.sessionsRestored, startupCalls);
+  fprintf(stderr, "%lld focus changes, %lld coalesced, %lld switches applied, %lld held, %lld refreshes.\n",
+    engineStats.focusChanges, engineStats.coalescedChanges, engineStats.switchesApplied,
+    engineStats.switchesHeld, engineStats.refreshes);
+  fprintf(stderr, "%lld focus changes to transient windows filtered.\n", engineStats.transientFiltered);
+  fprintf(stderr, "%lld backend calls (%lld failed), %lld of them leaving the session as it was.\n",
+    engineStats.backendCalls, engineStats.backendFailures, redundantCalls);
+  fprintf(stderr, "%lld volume callbacks dropped as echoes, %lld handled as external.\n",
+    engineStats.echoedChanges, engineStats.externalChanges);
+  if(pJournal)
+  {
+    fprintf(stderr, "%ld journal records in use after %lld compactions.\n",
+      JournalCount(pJournal -> head), engineStats.journalCompactions);
+  }
+  fprintf(stderr, "Stage latency (real time, percentiles to bucket bounds):\n");
+  for(int stage = 0; stage < LS_STAGE_COUNT; stage++) { ReportLatency((LatencyStage) stage); }
+  ReportTransitions(focusEvents, seconds);
+  PROCESS_MEMORY_COUNTERS memory;
+  memory.cb = sizeof(memory);
+  if(GetProcessMemoryInfo(GetCurrentProcess(), &memory, sizeof(memory)))
+  {
+    fprintf(stderr, "Peak working set %zu KB.\n", memory.PeakWorkingSetSize / 1024);
+  }
+  // Left with this replay's decisions, for the next one
+  CloseSnapshot();
+  CloseJournal();
+  ClearSessionStore();
+  for(auto p = sessions.begin(); p != sessions.end(); ++p) { p -> second -> Release(); }
+  CloseHandle(ghEvents[0]);
+  CloseHandle(ghEvents[1]);
+  DeleteCriticalSection(&hashmapCriticalSection);
+  return 0;
+}